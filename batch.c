@@ -0,0 +1,287 @@
+#include "vm.h"
+#include <linux/atomic.h>
+#include <linux/completion.h>
+#include <linux/cpumask.h>
+#include <linux/kernel.h>
+#include <linux/kthread.h>
+#include <linux/mm.h>
+#include <linux/sched/mm.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/topology.h>
+#include <linux/uaccess.h>
+
+#define BATCH_MAX_WORKERS 256
+#define BATCH_MAX_ARGC 256
+#define BATCH_MAX_BUFFER (16 * 1024 * 1024)
+
+// A batch run fans one program out over many inputs. Every worker takes a
+// single VM from the pool and reinitializes it for each item it picks up, so
+// the VM and its scratch buffers are set up once per worker, not per input.
+// Workers adopt the caller's address space and copy inputs and outputs
+// directly, which keeps the whole batch from being staged in kernel memory.
+
+struct batch_job {
+  struct soil_batch_args *args;
+  Byte *bin;
+  u64 bin_len;
+  struct mm_struct *mm;
+  atomic64_t next;
+  atomic_t running;
+  // Set once the caller was killed; workers stop picking up items.
+  bool cancelled;
+  struct completion done;
+};
+
+struct batch_worker {
+  struct batch_job *job;
+  soil_vm_t *vm;
+  Byte *input;
+  u64 input_cap;
+  Byte *output;
+  u64 output_cap;
+};
+
+// Makes sure *buf can hold len bytes, reusing it if it is already big enough.
+static int reserve_buffer(Byte **buf, u64 *cap, u64 len) {
+  if (len <= *cap)
+    return 0;
+  kvfree(*buf);
+  *buf = kvmalloc(len, GFP_KERNEL);
+  *cap = *buf ? len : 0;
+  return *buf ? 0 : -ENOMEM;
+}
+
+static void free_argv(int argc, char **argv) {
+  if (argv == NULL)
+    return;
+  for (int i = 0; i < argc; i++)
+    kfree(argv[i]);
+  kfree(argv);
+}
+
+static int copy_argv(soil_vm_t *vm, struct soil_batch_input *in) {
+  vm->argc = 0;
+  vm->argv = NULL;
+  if (in->argc == 0)
+    return 0;
+  if (in->argc < 0 || in->argc > BATCH_MAX_ARGC)
+    return -EINVAL;
+
+  char **uargv = kmalloc_array(in->argc, sizeof(char *), GFP_KERNEL);
+  char **argv = kcalloc(in->argc, sizeof(char *), GFP_KERNEL);
+  int res = 0;
+  if (uargv == NULL || argv == NULL) {
+    res = -ENOMEM;
+    goto out;
+  }
+  if (copy_from_user(uargv, in->argv, in->argc * sizeof(char *))) {
+    res = -EFAULT;
+    goto out;
+  }
+  for (int i = 0; i < in->argc; i++) {
+    argv[i] = strndup_user(uargv[i], PAGE_SIZE);
+    if (IS_ERR(argv[i])) {
+      res = PTR_ERR(argv[i]);
+      argv[i] = NULL;
+      goto out;
+    }
+  }
+  vm->argc = in->argc;
+  vm->argv = argv;
+  argv = NULL;
+out:
+  free_argv(in->argc, argv);
+  kfree(uargv);
+  return res;
+}
+
+static int prepare_item(struct batch_worker *w, struct soil_batch_input *in) {
+  soil_vm_t *vm = w->vm;
+  if (in->input_len > BATCH_MAX_BUFFER || in->output_cap > BATCH_MAX_BUFFER)
+    return -E2BIG;
+
+  int res = copy_argv(vm, in);
+  if (res != 0)
+    return res;
+
+  vm->input = NULL;
+  vm->input_len = 0;
+  if (in->input_len > 0) {
+    res = reserve_buffer(&w->input, &w->input_cap, in->input_len);
+    if (res != 0)
+      return res;
+    if (copy_from_user(w->input, in->input, in->input_len))
+      return -EFAULT;
+    vm->input = w->input;
+    vm->input_len = in->input_len;
+  }
+
+  vm->output = NULL;
+  vm->output_cap = 0;
+  if (in->output_cap > 0) {
+    res = reserve_buffer(&w->output, &w->output_cap, in->output_cap);
+    if (res != 0)
+      return res;
+    vm->output = w->output;
+    vm->output_cap = in->output_cap;
+  }
+  return 0;
+}
+
+static void run_item(struct batch_worker *w, u64 i) {
+  struct batch_job *job = w->job;
+  soil_vm_t *vm = w->vm;
+  struct soil_batch_input in;
+  struct soil_batch_result result = {0};
+
+  if (copy_from_user(&in, &job->args->inputs[i], sizeof(in))) {
+    result.error = -EFAULT;
+    goto out;
+  }
+  result.error = prepare_item(w, &in);
+  if (result.error != 0)
+    goto out;
+
+  clear_vm_memory(vm);
+  count_vm_run(vm);
+  set_vm_limits(vm, &job->args->qos);
+  init_vm(vm, job->bin, job->bin_len, job->args->flags);
+  run(vm);
+  // Parked VMs finish on the workqueue. Workers aren't killed themselves; if
+  // the caller is, it stops the VM.
+  wait_for_vm(vm);
+  if (READ_ONCE(job->cancelled))
+    result.error = -EINTR;
+
+  result.exit_code = vm->exit_code;
+  result.status = vm->status;
+  result.output_len = vm->output_len;
+  if (vm->output_len > 0 &&
+      copy_to_user(in.output, vm->output, vm->output_len))
+    result.error = -EFAULT;
+
+out:
+  free_argv(vm->argc, vm->argv);
+  vm->argc = 0;
+  vm->argv = NULL;
+  vm->input = NULL;
+  vm->output = NULL;
+  if (copy_to_user(&job->args->results[i], &result, sizeof(result)))
+    printk(KERN_INFO "Failed to copy batch result %llu to user\n", i);
+}
+
+static int batch_worker_fn(void *data) {
+  struct batch_worker *w = data;
+  struct batch_job *job = w->job;
+
+  kthread_use_mm(job->mm);
+  for (;;) {
+    u64 i = atomic64_inc_return(&job->next) - 1;
+    if (i >= job->args->len || READ_ONCE(job->cancelled))
+      break;
+    run_item(w, i);
+    cond_resched();
+  }
+  kthread_unuse_mm(job->mm);
+
+  if (atomic_dec_and_test(&job->running))
+    complete(&job->done);
+  return 0;
+}
+
+long run_batch(struct soil_batch_args *args, Byte *bin, u64 bin_len,
+               struct soil_syscall_table *syscalls,
+               struct soil_segment_set *segments) {
+  if (args->len == 0)
+    return 0;
+
+  u32 workers = args->parallelism ?: num_online_cpus();
+  workers = min_t(u64, workers, args->len);
+  workers = min_t(u32, workers, BATCH_MAX_WORKERS);
+
+  struct batch_job job = {
+      .args = args,
+      .bin = bin,
+      .bin_len = bin_len,
+      .mm = current->mm,
+  };
+  atomic64_set(&job.next, 0);
+  atomic_set(&job.running, 1);
+  init_completion(&job.done);
+
+  cpumask_var_t mask;
+  if (!alloc_cpumask_var(&mask, GFP_KERNEL))
+    return -ENOMEM;
+  long res = copy_qos_cpumask(&args->qos, mask);
+  if (res == 0 && (args->flags & SOIL_EXEC_NUMA_NODE)) {
+    res = valid_numa_node(args->qos.numa_node)
+              ? restrict_cpumask_to_node(mask, args->qos.numa_node)
+              : -EINVAL;
+  }
+  if (res != 0) {
+    free_cpumask_var(mask);
+    return res;
+  }
+
+  struct batch_worker *pool = kcalloc(workers, sizeof(*pool), GFP_KERNEL);
+  if (pool == NULL) {
+    free_cpumask_var(mask);
+    return -ENOMEM;
+  }
+
+  mmget(job.mm);
+  for (u32 i = 0; i < workers; i++) {
+    // Spread the workers over the allowed CPUs, one per CPU while they last,
+    // and give each a VM on the node of its CPU.
+    int cpu = cpumask_nth(i % cpumask_weight(mask), mask);
+    pool[i].job = &job;
+    pool[i].vm = pool_get_vm(cpu_to_node(cpu));
+    if (pool[i].vm == NULL) {
+      res = -ENOMEM;
+      break;
+    }
+    bind_syscall_table(pool[i].vm, syscalls);
+    bind_vm_segments(pool[i].vm, segments);
+    res = bind_vm_resume_qos(pool[i].vm, &args->qos, mask);
+    if (res != 0)
+      break;
+    struct task_struct *thread =
+        kthread_create_on_node(batch_worker_fn, &pool[i], cpu_to_node(cpu),
+                               "soil_batch/%u", i);
+    if (IS_ERR(thread)) {
+      res = PTR_ERR(thread);
+      break;
+    }
+    kthread_bind(thread, cpu);
+    apply_task_priority(thread, &args->qos);
+    atomic_inc(&job.running);
+    wake_up_process(thread);
+  }
+
+  // Drop the reference held while spawning; the last worker completes the job.
+  if (atomic_dec_and_test(&job.running))
+    complete(&job.done);
+  if (wait_for_completion_killable(&job.done) != 0) {
+    // The workers use this stack frame, so stop their VMs and wait for them
+    // anyway. A worker may start another item just as its VM is stopped, so
+    // keep stopping until all of them are gone.
+    WRITE_ONCE(job.cancelled, true);
+    do {
+      for (u32 i = 0; i < workers; i++)
+        if (pool[i].vm)
+          stop_vm(pool[i].vm);
+    } while (!wait_for_completion_timeout(&job.done, HZ / 10));
+    res = -EINTR;
+  }
+  mmput(job.mm);
+
+  for (u32 i = 0; i < workers; i++) {
+    pool_put_vm(pool[i].vm);
+    kvfree(pool[i].input);
+    kvfree(pool[i].output);
+  }
+  kfree(pool);
+  free_cpumask_var(mask);
+  return res;
+}
@@ -0,0 +1,254 @@
+#include "vm.h"
+#include <linux/atomic.h>
+#include <linux/idr.h>
+#include <linux/kernel.h>
+#include <linux/kref.h>
+#include <linux/log2.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+// Channels are single-producer single-consumer rings connecting two VMs.
+// Messages are framed with their length and copied straight from the
+// sender's guest memory into the ring and from there into the receiver's
+// guest memory. The producer only ever writes head and the consumer only
+// ever writes tail, so neither side needs a lock. A VM that has to wait parks
+// and leaves itself in the channel for the other side to unpark.
+
+#define CHANNEL_MAX_CAPACITY (64 * 1024 * 1024)
+
+struct soil_channel {
+  struct kref ref;
+  Byte *buf;
+  u64 cap;
+  bool closed;
+  bool has_sender;
+  bool has_receiver;
+  soil_vm_t *parked_sender;
+  soil_vm_t *parked_receiver;
+  u64 head ____cacheline_aligned_in_smp;
+  u64 tail ____cacheline_aligned_in_smp;
+};
+
+static DEFINE_MUTEX(channels_lock);
+static DEFINE_IDR(channels);
+
+#define REGA ((vm)->reg[SOIL_REG_A])
+#define REGB ((vm)->reg[SOIL_REG_B])
+#define REGC ((vm)->reg[SOIL_REG_C])
+
+static void free_channel(struct kref *ref) {
+  struct soil_channel *ch = container_of(ref, struct soil_channel, ref);
+  kvfree(ch->buf);
+  kfree(ch);
+}
+
+static void ring_write(struct soil_channel *ch, u64 pos, const void *src,
+                       u64 len) {
+  u64 off = pos & (ch->cap - 1);
+  u64 first = min(len, ch->cap - off);
+  memcpy(ch->buf + off, src, first);
+  memcpy(ch->buf, (const Byte *)src + first, len - first);
+}
+
+static void ring_read(struct soil_channel *ch, u64 pos, void *dst, u64 len) {
+  u64 off = pos & (ch->cap - 1);
+  u64 first = min(len, ch->cap - off);
+  memcpy(dst, ch->buf + off, first);
+  memcpy((Byte *)dst + first, ch->buf, len - first);
+}
+
+static u64 channel_space(struct soil_channel *ch) {
+  return ch->cap - (ch->head - smp_load_acquire(&ch->tail));
+}
+
+static bool channel_has_message(struct soil_channel *ch) {
+  return smp_load_acquire(&ch->head) - ch->tail >= sizeof(u64);
+}
+
+static struct soil_channel *vm_channel(soil_vm_t *vm, Word slot, u8 end) {
+  if (slot < 0 || slot >= SOIL_VM_CHANNELS)
+    return NULL;
+  if (vm->channels[slot].channel == NULL || vm->channels[slot].end != end)
+    return NULL;
+  return vm->channels[slot].channel;
+}
+
+static void unpark_waiter(soil_vm_t **waiter) {
+  soil_vm_t *vm = xchg(waiter, NULL);
+  if (vm)
+    soil_vm_unpark(vm);
+}
+
+// Evaluates to whether cond holds. If it doesn't, this returns from the
+// syscall and parks the VM in front of it, so it runs again once the other
+// side made progress. Evaluates to false if cond will never hold because the
+// channel was closed, or if the VM can't park.
+#define WAIT_FOR_CHANNEL(vm, ch, waiter, cond)                                 \
+  ({                                                                           \
+    bool ok = (cond);                                                          \
+    if (!ok && !READ_ONCE((ch)->closed) && soil_vm_can_park(vm)) {             \
+      soil_vm_park_restart(vm);                                                \
+      WRITE_ONCE(waiter, vm);                                                  \
+      /* Pairs with the barrier in unpark_waiter. */                           \
+      smp_mb();                                                                \
+      if ((cond) || READ_ONCE((ch)->closed))                                   \
+        unpark_waiter(&(waiter));                                              \
+      return;                                                                  \
+    }                                                                          \
+    ok;                                                                        \
+  })
+
+void syscall_channel_send(soil_vm_t *vm) {
+  struct soil_channel *ch = vm_channel(vm, REGA, SOIL_CHANNEL_SEND);
+  if (ch == NULL) {
+    soil_vm_panic(vm, "no channel to send to in slot %ld", REGA);
+    return;
+  }
+  u64 len = REGC;
+  Byte *data = soil_guest_ptr(vm, REGB, len, false);
+  if (data == NULL || len + sizeof(len) > ch->cap) {
+    soil_vm_panic(vm, "invalid message of %llu bytes", len);
+    return;
+  }
+  if (!WAIT_FOR_CHANNEL(vm, ch, ch->parked_sender,
+                        channel_space(ch) >= len + sizeof(len))) {
+    REGA = -1;
+    return;
+  }
+  ring_write(ch, ch->head, &len, sizeof(len));
+  ring_write(ch, ch->head + sizeof(len), data, len);
+  smp_store_release(&ch->head, ch->head + sizeof(len) + len);
+  unpark_waiter(&ch->parked_receiver);
+  REGA = 0;
+}
+
+static void receive(soil_vm_t *vm, bool block) {
+  struct soil_channel *ch = vm_channel(vm, REGA, SOIL_CHANNEL_RECEIVE);
+  if (ch == NULL) {
+    soil_vm_panic(vm, "no channel to receive from in slot %ld", REGA);
+    return;
+  }
+  Byte *dst = soil_guest_ptr(vm, REGB, REGC, true);
+  if (dst == NULL) {
+    soil_vm_panic(vm, "invalid receive buffer");
+    return;
+  }
+  if (!(block ? WAIT_FOR_CHANNEL(vm, ch, ch->parked_receiver,
+                                 channel_has_message(ch))
+              : channel_has_message(ch))) {
+    REGA = -1;
+    return;
+  }
+  u64 len;
+  ring_read(ch, ch->tail, &len, sizeof(len));
+  // Messages that don't fit are truncated; the guest sees the full length.
+  ring_read(ch, ch->tail + sizeof(len), dst, min_t(u64, len, REGC));
+  smp_store_release(&ch->tail, ch->tail + sizeof(len) + len);
+  unpark_waiter(&ch->parked_sender);
+  REGA = len;
+}
+
+void syscall_channel_receive(soil_vm_t *vm) { receive(vm, true); }
+
+void syscall_channel_try_receive(soil_vm_t *vm) { receive(vm, false); }
+
+long create_channel(u64 capacity, u64 *handle) {
+  if (capacity < 2 * sizeof(u64) || capacity > CHANNEL_MAX_CAPACITY)
+    return -EINVAL;
+  struct soil_channel *ch = kzalloc(sizeof(*ch), GFP_KERNEL);
+  if (ch == NULL)
+    return -ENOMEM;
+  ch->cap = roundup_pow_of_two(capacity);
+  ch->buf = kvmalloc(ch->cap, GFP_KERNEL);
+  if (ch->buf == NULL) {
+    kfree(ch);
+    return -ENOMEM;
+  }
+  kref_init(&ch->ref);
+
+  mutex_lock(&channels_lock);
+  int id = idr_alloc(&channels, ch, 0, 0, GFP_KERNEL);
+  mutex_unlock(&channels_lock);
+  if (id < 0) {
+    kref_put(&ch->ref, free_channel);
+    return id;
+  }
+  *handle = id;
+  return 0;
+}
+
+long bind_channel(soil_vm_t *vm, u64 handle, u8 slot, u8 end) {
+  if (slot >= SOIL_VM_CHANNELS ||
+      (end != SOIL_CHANNEL_SEND && end != SOIL_CHANNEL_RECEIVE))
+    return -EINVAL;
+  if (vm->channels[slot].channel != NULL)
+    return -EBUSY;
+
+  long res = 0;
+  mutex_lock(&channels_lock);
+  struct soil_channel *ch =
+      handle > INT_MAX ? NULL : idr_find(&channels, handle);
+  bool *taken = ch == NULL                  ? NULL
+                : end == SOIL_CHANNEL_SEND ? &ch->has_sender
+                                           : &ch->has_receiver;
+  if (ch == NULL) {
+    res = -ENOENT;
+  } else if (*taken) {
+    // There is only ever one producer and one consumer.
+    res = -EBUSY;
+  } else {
+    *taken = true;
+    kref_get(&ch->ref);
+    vm->channels[slot].channel = ch;
+    vm->channels[slot].end = end;
+  }
+  mutex_unlock(&channels_lock);
+  return res;
+}
+
+void release_vm_channels(soil_vm_t *vm) {
+  mutex_lock(&channels_lock);
+  for (int i = 0; i < SOIL_VM_CHANNELS; i++) {
+    struct soil_channel *ch = vm->channels[i].channel;
+    if (ch == NULL)
+      continue;
+    // A VM stopped while it was parked is still left in the channel, and the
+    // other side must not unpark it once the VM is reused.
+    if (vm->channels[i].end == SOIL_CHANNEL_SEND) {
+      ch->has_sender = false;
+      cmpxchg(&ch->parked_sender, vm, NULL);
+    } else {
+      ch->has_receiver = false;
+      cmpxchg(&ch->parked_receiver, vm, NULL);
+    }
+    kref_put(&ch->ref, free_channel);
+    vm->channels[i].channel = NULL;
+  }
+  mutex_unlock(&channels_lock);
+}
+
+long destroy_channel(u64 handle) {
+  mutex_lock(&channels_lock);
+  struct soil_channel *ch =
+      handle > INT_MAX ? NULL : idr_remove(&channels, handle);
+  mutex_unlock(&channels_lock);
+  if (ch == NULL)
+    return -ENOENT;
+  // Parked VMs give up; bound VMs keep the channel alive until released.
+  WRITE_ONCE(ch->closed, true);
+  smp_mb();
+  unpark_waiter(&ch->parked_sender);
+  unpark_waiter(&ch->parked_receiver);
+  kref_put(&ch->ref, free_channel);
+  return 0;
+}
+
+void destroy_all_channels(void) {
+  struct soil_channel *ch;
+  int handle;
+  idr_for_each_entry(&channels, ch, handle) {
+    destroy_channel(handle);
+  }
+  idr_destroy(&channels);
+}
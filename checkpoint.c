@@ -0,0 +1,208 @@
+#include "vm.h"
+#include <linux/atomic.h>
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#include <linux/log2.h>
+#include <linux/moduleparam.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+// A checkpoint holds everything needed to continue a VM elsewhere: a header
+// with the registers, then the byte code, the call stack, the try stack and
+// finally every guest memory page that contains a non-zero byte, each
+// prefixed with its page number. Debug labels point into the original binary
+// and are not saved.
+
+#define CHECKPOINT_MAGIC "soilckpt"
+#define CHECKPOINT_VERSION 1
+#define CHECKPOINT_PAGE_SIZE 4096
+#define CHECKPOINT_MAX_BYTE_CODE (16 * 1024 * 1024)
+
+struct checkpoint_header {
+  char magic[8];
+  u32 version;
+  u32 flags;
+  Word ip;
+  Word reg[8];
+  Word exit_code;
+  Word mem_size;
+  u64 byte_code_len;
+  u64 call_stack_len;
+  u64 try_stack_len;
+  u64 page_count;
+};
+
+static char *crash_dump_dir;
+module_param(crash_dump_dir, charp, 0644);
+MODULE_PARM_DESC(crash_dump_dir,
+                 "Directory to write a checkpoint of panicking VMs to");
+
+static atomic_t crash_dump_count = ATOMIC_INIT(0);
+
+static u64 page_len(u64 page) {
+  return min_t(u64, CHECKPOINT_PAGE_SIZE,
+               MEMORY_ALLOC_SIZE - page * CHECKPOINT_PAGE_SIZE);
+}
+
+static u64 page_count(void) {
+  return DIV_ROUND_UP(MEMORY_ALLOC_SIZE, CHECKPOINT_PAGE_SIZE);
+}
+
+static bool page_is_zero(soil_vm_t *vm, u64 page) {
+  // Guest memory is only allocated once a program is initialized.
+  if (vm->mem == NULL)
+    return true;
+  return memchr_inv(vm->mem + page * CHECKPOINT_PAGE_SIZE, 0,
+                    page_len(page)) == NULL;
+}
+
+ssize_t checkpoint_vm(soil_vm_t *vm, Byte **out) {
+  struct checkpoint_header header = {
+      .magic = CHECKPOINT_MAGIC,
+      .version = CHECKPOINT_VERSION,
+      .flags = vm->flags,
+      .ip = vm->ip,
+      .exit_code = vm->exit_code,
+      .mem_size = vm->mem_size,
+      .byte_code_len = vm->byte_code_len,
+      .call_stack_len = vm->call_stack_len,
+      .try_stack_len = vm->try_stack_len,
+  };
+  memcpy(header.reg, vm->reg, sizeof(header.reg));
+
+  u64 len = sizeof(header) + header.byte_code_len +
+            header.call_stack_len * sizeof(Word) +
+            header.try_stack_len * sizeof(Try);
+  for (u64 page = 0; page < page_count(); page++) {
+    if (page_is_zero(vm, page))
+      continue;
+    header.page_count++;
+    len += sizeof(u64) + page_len(page);
+  }
+
+  Byte *buf = kvmalloc(len, GFP_KERNEL);
+  if (buf == NULL)
+    return -ENOMEM;
+
+  Byte *cursor = buf;
+#define PUT(src, n)                                                            \
+  ({                                                                           \
+    memcpy(cursor, src, n);                                                    \
+    cursor += n;                                                               \
+  })
+  PUT(&header, sizeof(header));
+  PUT(vm->byte_code, header.byte_code_len);
+  PUT(vm->call_stack, header.call_stack_len * sizeof(Word));
+  PUT(vm->try_stack, header.try_stack_len * sizeof(Try));
+  for (u64 page = 0; page < page_count(); page++) {
+    if (page_is_zero(vm, page))
+      continue;
+    PUT(&page, sizeof(page));
+    PUT(vm->mem + page * CHECKPOINT_PAGE_SIZE, page_len(page));
+  }
+#undef PUT
+
+  *out = buf;
+  return len;
+}
+
+int restore_vm(soil_vm_t *vm, const Byte *buf, u64 len) {
+  const Byte *cursor = buf;
+  const Byte *end = buf + len;
+#define TAKE(dst, n)                                                           \
+  ({                                                                           \
+    if ((u64)(end - cursor) < (u64)(n))                                        \
+      return -EINVAL;                                                          \
+    memcpy(dst, cursor, n);                                                    \
+    cursor += n;                                                               \
+  })
+
+  struct checkpoint_header header;
+  TAKE(&header, sizeof(header));
+  if (memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != CHECKPOINT_VERSION)
+    return -EINVAL;
+  // Memory caps shrink guest memory; masked VMs keep a power of two.
+  bool masked = header.flags & SOIL_EXEC_MASKED_MEMORY;
+  Word max_mem_size = masked ? MASKED_MEMORY_SIZE : MEMORY_SIZE;
+  if (header.mem_size < 8 || header.mem_size > max_mem_size ||
+      (masked && !is_power_of_2(header.mem_size)) ||
+      header.byte_code_len > CHECKPOINT_MAX_BYTE_CODE ||
+      header.call_stack_len > CALL_STACK_SIZE ||
+      header.try_stack_len > TRY_STACK_SIZE)
+    return -EINVAL;
+
+  Byte *byte_code =
+      kmalloc_node(header.byte_code_len, GFP_KERNEL, vm->numa_node);
+  if (byte_code == NULL || alloc_vm_memory(vm) != 0 ||
+      reserve_vm_stacks(vm, header.call_stack_len, header.try_stack_len) != 0) {
+    kfree(byte_code);
+    return -ENOMEM;
+  }
+
+  deinit_vm(vm);
+  clear_vm_memory(vm);
+  vm->byte_code = byte_code;
+  vm->byte_code_len = header.byte_code_len;
+  // Checkpoints come from user space, which must not set internal flags.
+  vm->flags = header.flags & SOIL_EXEC_FLAGS;
+  vm->ip = header.ip;
+  memcpy(vm->reg, header.reg, sizeof(vm->reg));
+  vm->exit_code = header.exit_code;
+  vm->mem_size = header.mem_size;
+  vm->mem_mask = header.mem_size - 1;
+  vm->call_stack_len = header.call_stack_len;
+  vm->try_stack_len = header.try_stack_len;
+  // Leave the VM exited if the checkpoint turns out to be truncated.
+  vm->status = SOIL_VM_EXITED;
+
+  TAKE(vm->byte_code, header.byte_code_len);
+  TAKE(vm->call_stack, header.call_stack_len * sizeof(Word));
+  TAKE(vm->try_stack, header.try_stack_len * sizeof(Try));
+  for (u64 i = 0; i < header.page_count; i++) {
+    u64 page;
+    TAKE(&page, sizeof(page));
+    if (page >= page_count())
+      return -EINVAL;
+    TAKE(vm->mem + page * CHECKPOINT_PAGE_SIZE, page_len(page));
+    vm->dirty_lo = min_t(Word, vm->dirty_lo, page * CHECKPOINT_PAGE_SIZE);
+    vm->dirty_hi = max_t(Word, vm->dirty_hi,
+                         page * CHECKPOINT_PAGE_SIZE + page_len(page));
+  }
+#undef TAKE
+
+  vm->status = SOIL_VM_PAUSED;
+  return 0;
+}
+
+void dump_vm_to_file(soil_vm_t *vm) {
+  // Writing files may sleep, which VMs in atomic context such as netfilter
+  // hooks must not. in_task() isn't enough: hooks like NF_INET_LOCAL_OUT run
+  // in process context with bottom halves disabled.
+  if (crash_dump_dir == NULL || (vm->flags & SOIL_VM_ATOMIC))
+    return;
+
+  Byte *buf;
+  ssize_t len = checkpoint_vm(vm, &buf);
+  if (len < 0)
+    return;
+
+  char path[256];
+  snprintf(path, sizeof(path), "%s/soil-crash-%d.ckpt", crash_dump_dir,
+           atomic_inc_return(&crash_dump_count));
+  struct file *file =
+      filp_open(path, O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, 0600);
+  if (IS_ERR(file)) {
+    printk(KERN_INFO "Failed to open %s for the memory dump\n", path);
+    kvfree(buf);
+    return;
+  }
+  loff_t pos = 0;
+  ssize_t written = kernel_write(file, buf, len, &pos);
+  filp_close(file, NULL);
+  kvfree(buf);
+  if (written == len)
+    printk(KERN_INFO "Memory dumped to %s.\n", path);
+  else
+    printk(KERN_INFO "Failed to write the memory dump to %s\n", path);
+}
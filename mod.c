@@ -8,6 +8,8 @@
 #include <linux/kernel.h>
 #include <linux/kthread.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/numa.h>
 #include <linux/sched.h>
 #include <linux/uaccess.h>
 
@@ -18,40 +20,146 @@ MODULE_AUTHOR("Marcel Garus");
 struct bintable_entry {
   char binary[1024];
   u64 len;
+  struct soil_syscall_table *syscalls;
+  struct soil_segment_set *segments;
 };
 
 struct bintable_entry bintable[1024];
 u64 bintable_len = 0;
+// Held while loading, unloading or changing programs and while taking
+// references to their syscalls and segments. The binary of a loaded program
+// never changes, so it can be read without the lock.
+static DEFINE_MUTEX(bintable_lock);
 
-soil_vm_t *vmtable[1024];
+soil_vm_t *vmtable[SOIL_MAX_VMS];
 u64 vmtable_len = 0;
+// Held while looking up VMs in the table and touching them from an ioctl, so
+// that a VM can't be deleted or started under another ioctl.
+static DEFINE_MUTEX(vmtable_lock);
 
 static int handle_open(struct inode *inode, struct file *file) { return 0; }
 
 static int handle_release(struct inode *inode, struct file *file) { return 0; }
 
-int validate_vm_args(struct soil_vm_run_args *args) {
-  struct bintable_entry program = bintable[args->program];
-  if (program.len == 0) {
-    return -1;
+static int handle_mmap(struct file *file, struct vm_area_struct *vma) {
+  return mmap_vm_status(vma);
+}
+
+static soil_vm_t *lookup_vm(soil_vm_idx idx) {
+  if (idx >= vmtable_len) {
+    return NULL;
   }
-  soil_vm_t *vm = vmtable[args->vm];
-  if (vm == NULL) {
-    return -2;
+  return vmtable[idx];
+}
+
+// VMs that are starting, running or parked can't be touched from the
+// outside.
+static bool vm_is_busy(soil_vm_t *vm) {
+  soil_vm_status_t status = READ_ONCE(vm->status);
+  if (status == SOIL_VM_STARTING || status == SOIL_VM_RUNNING ||
+      status == SOIL_VM_PAUSING || status == SOIL_VM_PARKING ||
+      status == SOIL_VM_PARKED)
+    return true;
+  // The thread that stopped the VM publishes its status right after, and the
+  // caller must not write the status entry at the same time.
+  wait_for_runner(vm);
+  return false;
+}
+
+// Puts a new VM into the next slot of the VM table and tells user space
+// about it.
+static long add_vm(soil_vm_t *vm, soil_vm_idx *idx) {
+  mutex_lock(&vmtable_lock);
+  if (vmtable_len >= SOIL_MAX_VMS) {
+    mutex_unlock(&vmtable_lock);
+    pool_put_vm(vm);
+    return -ENOSPC;
   }
+  u64 slot = vmtable_len++;
+  vm->idx = slot;
+  publish_vm_status(vm);
+  vmtable[slot] = vm;
+  mutex_unlock(&vmtable_lock);
+  copy_to_user(idx, &slot, sizeof(slot));
   return 0;
 }
 
+// Checks the arguments of a run and claims the VM by moving it to
+// SOIL_VM_STARTING, which keeps other ioctls away from it until it has run.
+// The previous status is returned in *old for runs that fail to start.
+static long claim_vm(struct soil_vm_run_args *args, soil_vm_t **claimed,
+                     soil_vm_status_t *old) {
+  long res = 0;
+  mutex_lock(&vmtable_lock);
+  soil_vm_t *vm = lookup_vm(args->vm);
+  if (vm == NULL) {
+    res = -2;
+  } else if (vm_is_busy(vm)) {
+    res = -EBUSY;
+  } else if (args->flags & SOIL_EXEC_RESUME) {
+    // Resuming continues the program the VM already holds.
+    if (vm->status != SOIL_VM_PAUSED)
+      res = -EBUSY;
+  }
+  if (res == 0) {
+    *old = vm->status;
+    *claimed = vm;
+    WRITE_ONCE(vm->status, SOIL_VM_STARTING);
+  }
+  mutex_unlock(&vmtable_lock);
+  return res;
+}
+
+// Returns a loaded program with references to its syscalls and segments, or
+// NULL if it isn't loaded. The caller puts the references.
+static struct bintable_entry *get_program(soil_program_idx idx,
+                                          struct soil_syscall_table **syscalls,
+                                          struct soil_segment_set **segments) {
+  struct bintable_entry *program = NULL;
+  mutex_lock(&bintable_lock);
+  if (idx < bintable_len && bintable[idx].len != 0) {
+    program = &bintable[idx];
+    *syscalls = get_syscall_table(program->syscalls);
+    *segments = get_segment_set(program->segments);
+  }
+  mutex_unlock(&bintable_lock);
+  return program;
+}
+
+static void put_program(struct soil_syscall_table *syscalls,
+                        struct soil_segment_set *segments) {
+  // Unloaded programs have no syscalls left.
+  if (syscalls)
+    put_syscall_table(syscalls);
+  put_segment_set(segments);
+}
+
+// Gives back a VM claimed by a run that couldn't start.
+static void unclaim_vm(soil_vm_t *vm, soil_vm_status_t old) {
+  WRITE_ONCE(vm->status, old);
+}
+
 int start_soil_vm(void *data) {
   struct soil_vm_run_args *args = (struct soil_vm_run_args *)data;
 
   soil_vm_t *vm = vmtable[args->vm];
-  struct bintable_entry program = bintable[args->program];
-  init_vm(vm, (Byte *)program.binary, program.len);
+  count_vm_run(vm);
+  set_vm_limits(vm, &args->qos);
+  if (!(args->flags & SOIL_EXEC_RESUME)) {
+    // The ioctl bound the program's syscalls and segments already.
+    struct bintable_entry *program = &bintable[args->program];
+    init_vm(vm, (Byte *)program->binary, program->len, args->flags);
+  }
   run(vm);
   return 0;
 }
 
+static int start_soil_vm_async(void *data) {
+  start_soil_vm(data);
+  kfree(data);
+  return 0;
+}
+
 static long handle_ioctl(struct file *filp, unsigned int cmd,
                          unsigned long arg) {
   printk(KERN_INFO "cmd = %d, arg = %p\n", cmd, (char *)arg);
@@ -65,22 +173,52 @@ static long handle_ioctl(struct file *filp, unsigned int cmd,
     }
     printk(KERN_INFO "%d\n", prog.len);
     struct bintable_entry entry;
+    if (prog.len > sizeof(entry.binary)) {
+      return -E2BIG;
+    }
     copy_from_user(entry.binary, prog.program, prog.len);
     entry.len = prog.len;
+    // Native syscalls are bound when the program is loaded.
+    entry.syscalls = snapshot_syscall_table();
+    if (entry.syscalls == NULL) {
+      return -ENOMEM;
+    }
+    entry.segments = NULL;
 
-    bintable[bintable_len] = entry;
-    copy_to_user(prog.idx, &bintable_len, sizeof(bintable_len));
-    bintable_len++;
+    mutex_lock(&bintable_lock);
+    if (bintable_len >= ARRAY_SIZE(bintable)) {
+      mutex_unlock(&bintable_lock);
+      put_syscall_table(entry.syscalls);
+      return -ENOSPC;
+    }
+    u64 idx = bintable_len++;
+    bintable[idx] = entry;
+    mutex_unlock(&bintable_lock);
+    copy_to_user(prog.idx, &idx, sizeof(idx));
 
     return 0;
 
   } else if (cmd == SOIL_IOCTL_CREATE_VM) {
-    soil_vm_t *vm = kmalloc(sizeof(soil_vm_t), GFP_KERNEL);
-    vmtable[vmtable_len] = vm;
-    copy_to_user((soil_vm_idx *)arg, &vmtable_len, sizeof(vmtable_len));
-    vmtable_len++;
-
-    return 0;
+    soil_vm_t *vm = pool_get_vm(NUMA_NO_NODE);
+    if (vm == NULL) {
+      return -ENOMEM;
+    }
+    return add_vm(vm, (soil_vm_idx *)arg);
+  } else if (cmd == SOIL_IOCTL_CREATE_VM_ON_NODE) {
+    struct soil_vm_create_args args;
+    if (copy_from_user(&args, (struct soil_vm_create_args *)arg,
+                       sizeof(struct soil_vm_create_args)) != 0) {
+      printk("Failed to copy param from user\n");
+      return -EFAULT;
+    }
+    if (!valid_numa_node(args.numa_node)) {
+      return -EINVAL;
+    }
+    soil_vm_t *vm = pool_get_vm(args.numa_node);
+    if (vm == NULL) {
+      return -ENOMEM;
+    }
+    return add_vm(vm, args.vm);
   } else if (cmd == SOIL_IOCTL_RUN) {
     struct soil_vm_run_args args;
     int res = copy_from_user(&args, (struct soil_vm_run_args *)arg,
@@ -90,40 +228,351 @@ static long handle_ioctl(struct file *filp, unsigned int cmd,
       printk("Failed to copy param from user\n");
       return 1;
     }
+    args.flags &= SOIL_EXEC_FLAGS;
 
-    res = validate_vm_args(&args);
-    if (res != 0) {
-      return res;
+    soil_vm_t *vm;
+    soil_vm_status_t old;
+    long claim_res = claim_vm(&args, &vm, &old);
+    if (claim_res != 0) {
+      return claim_res;
+    }
+    if (!(args.flags & SOIL_EXEC_RESUME)) {
+      struct soil_syscall_table *syscalls;
+      struct soil_segment_set *segments;
+      if (get_program(args.program, &syscalls, &segments) == NULL) {
+        unclaim_vm(vm, old);
+        return -1;
+      }
+      bind_syscall_table(vm, syscalls);
+      bind_vm_segments(vm, segments);
+      put_program(syscalls, segments);
     }
 
     if (args.flags & SOIL_EXEC_ASYNC) {
-      struct task_struct *thread = kthread_run(start_soil_vm, &args, "soil_vm");
+      cpumask_var_t mask;
+      if (!alloc_cpumask_var(&mask, GFP_KERNEL)) {
+        unclaim_vm(vm, old);
+        return -ENOMEM;
+      }
+      res = copy_qos_cpumask(&args.qos, mask);
+      if (res == 0) {
+        res = place_vm(vm, args.flags, &args.qos, mask);
+      }
+      if (res == 0) {
+        // After parking, the VM resumes with the same mask and priority.
+        res = bind_vm_resume_qos(vm, &args.qos, mask);
+      }
+      if (res != 0) {
+        free_cpumask_var(mask);
+        unclaim_vm(vm, old);
+        return res;
+      }
+      // The thread outlives this call, so it gets its own copy of the args.
+      struct soil_vm_run_args *async_args =
+          kmemdup(&args, sizeof(args), GFP_KERNEL);
+      if (async_args == NULL) {
+        free_cpumask_var(mask);
+        unclaim_vm(vm, old);
+        return -ENOMEM;
+      }
+      struct task_struct *thread = kthread_create_on_node(
+          start_soil_vm_async, async_args, vm->numa_node, "soil_vm");
+      if (IS_ERR(thread)) {
+        free_cpumask_var(mask);
+        kfree(async_args);
+        unclaim_vm(vm, old);
+        return PTR_ERR(thread);
+      }
+      set_cpus_allowed_ptr(thread, mask);
+      apply_task_priority(thread, &args.qos);
+      free_cpumask_var(mask);
+      wake_up_process(thread);
     } else {
+      res = place_vm(vm, args.flags, &args.qos, NULL);
+      if (res == 0) {
+        // Synchronous runs have no mask or priority to keep.
+        res = bind_vm_resume_qos(vm, NULL, NULL);
+      }
+      if (res != 0) {
+        unclaim_vm(vm, old);
+        return res;
+      }
       start_soil_vm(&args);
+      // The VM may have parked and continue on the workqueue.
+      return wait_for_vm(vm);
     }
 
     return 0;
   } else if (cmd == SOIL_IOCTL_VM_STATUS) {
     struct soil_vm_status_args args;
-    copy_from_user(&args, (struct soil_vm_status_args *)arg,
-                   sizeof(struct soil_vm_status_args));
-
-    soil_vm_t *vm = vmtable[args.vm];
-    copy_to_user(args.status, &vm->status, sizeof(soil_vm_status_t));
-
+    if (copy_from_user(&args, (struct soil_vm_status_args *)arg,
+                       sizeof(struct soil_vm_status_args)) != 0) {
+      printk("Failed to copy param from user\n");
+      return -EFAULT;
+    }
+    mutex_lock(&vmtable_lock);
+    soil_vm_t *vm = lookup_vm(args.vm);
+    soil_vm_status_t status = vm ? READ_ONCE(vm->status) : SOIL_VM_INIT;
+    mutex_unlock(&vmtable_lock);
+    if (vm == NULL) {
+      return -2;
+    }
+    if (copy_to_user(args.status, &status, sizeof(soil_vm_status_t)) != 0) {
+      return -EFAULT;
+    }
     return 0;
   } else if (cmd == SOIL_IOCTL_UNLOAD_BINARY) {
+    mutex_lock(&bintable_lock);
+    if (arg >= bintable_len) {
+      mutex_unlock(&bintable_lock);
+      return -1;
+    }
     struct bintable_entry *entry = &bintable[arg];
     entry->len = 0;
+    // VMs running the program hold references of their own.
+    put_program(entry->syscalls, entry->segments);
+    entry->syscalls = NULL;
+    entry->segments = NULL;
+    mutex_unlock(&bintable_lock);
     return 0;
   } else if (cmd == SOIL_IOCTL_DELETE_VM) {
-    soil_vm_t *vm = vmtable[arg];
-    kfree(vm->byte_code);
-    if (vm->labels.len != 0) {
-      kfree(vm->labels.entries);
+    mutex_lock(&vmtable_lock);
+    soil_vm_t *vm = lookup_vm(arg);
+    if (vm == NULL) {
+      mutex_unlock(&vmtable_lock);
+      return -2;
+    }
+    if (vm_is_busy(vm)) {
+      mutex_unlock(&vmtable_lock);
+      return -EBUSY;
+    }
+    vmtable[arg] = NULL;
+    clear_vm_status(arg);
+    mutex_unlock(&vmtable_lock);
+    // Nobody can reach the VM anymore.
+    pool_put_vm(vm);
+    return 0;
+  } else if (cmd == SOIL_IOCTL_RUN_BATCH) {
+    struct soil_batch_args args;
+    if (copy_from_user(&args, (struct soil_batch_args *)arg,
+                       sizeof(struct soil_batch_args)) != 0) {
+      printk("Failed to copy param from user\n");
+      return -EFAULT;
+    }
+    args.flags &= SOIL_EXEC_FLAGS;
+    struct soil_syscall_table *syscalls;
+    struct soil_segment_set *segments;
+    struct bintable_entry *program =
+        get_program(args.program, &syscalls, &segments);
+    if (program == NULL) {
+      return -1;
+    }
+    long res = run_batch(&args, (Byte *)program->binary, program->len,
+                         syscalls, segments);
+    put_program(syscalls, segments);
+    return res;
+  } else if (cmd == SOIL_IOCTL_PAUSE_VM) {
+    long res = 0;
+    mutex_lock(&vmtable_lock);
+    soil_vm_t *vm = lookup_vm(arg);
+    if (vm == NULL) {
+      res = -2;
+    } else if (cmpxchg(&vm->status, SOIL_VM_RUNNING, SOIL_VM_PAUSING) !=
+               SOIL_VM_RUNNING) {
+      // The run loop notices the new status after the current instruction
+      // and moves the VM to SOIL_VM_PAUSED.
+      res = -EINVAL;
+    }
+    mutex_unlock(&vmtable_lock);
+    return res;
+  } else if (cmd == SOIL_IOCTL_CHECKPOINT) {
+    struct soil_vm_checkpoint_args args;
+    if (copy_from_user(&args, (struct soil_vm_checkpoint_args *)arg,
+                       sizeof(struct soil_vm_checkpoint_args)) != 0) {
+      printk("Failed to copy param from user\n");
+      return -EFAULT;
+    }
+    mutex_lock(&vmtable_lock);
+    soil_vm_t *vm = lookup_vm(args.vm);
+    if (vm == NULL) {
+      mutex_unlock(&vmtable_lock);
+      return -2;
+    }
+    // Guest threads of a paused VM keep running and aren't part of the
+    // checkpoint.
+    if (vm_is_busy(vm) || vm->group) {
+      mutex_unlock(&vmtable_lock);
+      return -EBUSY;
+    }
+
+    Byte *buf;
+    ssize_t len = checkpoint_vm(vm, &buf);
+    mutex_unlock(&vmtable_lock);
+    if (len < 0) {
+      return len;
+    }
+    long res = 0;
+    u64 ulen = len;
+    if (copy_to_user(args.len, &ulen, sizeof(ulen)) != 0) {
+      res = -EFAULT;
+    } else if (ulen > args.cap) {
+      // The caller can retry with a buffer of the reported size.
+      res = -ENOSPC;
+    } else if (copy_to_user(args.buf, buf, ulen) != 0) {
+      res = -EFAULT;
+    }
+    kvfree(buf);
+    return res;
+  } else if (cmd == SOIL_IOCTL_RESTORE) {
+    struct soil_vm_restore_args args;
+    if (copy_from_user(&args, (struct soil_vm_restore_args *)arg,
+                       sizeof(struct soil_vm_restore_args)) != 0) {
+      printk("Failed to copy param from user\n");
+      return -EFAULT;
+    }
+    Byte *buf = kvmalloc(args.len, GFP_KERNEL);
+    if (buf == NULL) {
+      return -ENOMEM;
+    }
+    if (copy_from_user(buf, args.buf, args.len) != 0) {
+      kvfree(buf);
+      return -EFAULT;
+    }
+    long res = 0;
+    mutex_lock(&vmtable_lock);
+    soil_vm_t *vm = lookup_vm(args.vm);
+    if (vm == NULL) {
+      res = -2;
+    } else if (vm_is_busy(vm)) {
+      res = -EBUSY;
+    } else {
+      res = restore_vm(vm, buf, args.len);
+      publish_vm_status(vm);
+    }
+    mutex_unlock(&vmtable_lock);
+    kvfree(buf);
+    return res;
+  } else if (cmd == SOIL_IOCTL_NF_ATTACH) {
+    struct soil_nf_attach_args args;
+    if (copy_from_user(&args, (struct soil_nf_attach_args *)arg,
+                       sizeof(struct soil_nf_attach_args)) != 0) {
+      printk("Failed to copy param from user\n");
+      return -EFAULT;
+    }
+    struct soil_syscall_table *syscalls;
+    struct soil_segment_set *segments;
+    struct bintable_entry *program =
+        get_program(args.program, &syscalls, &segments);
+    if (program == NULL) {
+      return -1;
+    }
+    long res = attach_nf_program(&args, (Byte *)program->binary, program->len,
+                                 syscalls, segments);
+    put_program(syscalls, segments);
+    return res;
+  } else if (cmd == SOIL_IOCTL_NF_DETACH) {
+    return detach_nf_program(arg);
+  } else if (cmd == SOIL_IOCTL_NF_STATS) {
+    struct soil_nf_stats_args args;
+    if (copy_from_user(&args, (struct soil_nf_stats_args *)arg,
+                       sizeof(struct soil_nf_stats_args)) != 0) {
+      printk("Failed to copy param from user\n");
+      return -EFAULT;
+    }
+    struct soil_nf_stats stats;
+    long res = get_nf_stats(args.handle, &stats);
+    if (res != 0) {
+      return res;
+    }
+    if (copy_to_user(args.stats, &stats, sizeof(stats)) != 0) {
+      return -EFAULT;
+    }
+    return 0;
+  } else if (cmd == SOIL_IOCTL_CREATE_CHANNEL) {
+    struct soil_channel_args args;
+    if (copy_from_user(&args, (struct soil_channel_args *)arg,
+                       sizeof(struct soil_channel_args)) != 0) {
+      printk("Failed to copy param from user\n");
+      return -EFAULT;
+    }
+    u64 handle;
+    long res = create_channel(args.capacity, &handle);
+    if (res != 0) {
+      return res;
+    }
+    if (copy_to_user(args.channel, &handle, sizeof(handle)) != 0) {
+      destroy_channel(handle);
+      return -EFAULT;
+    }
+    return 0;
+  } else if (cmd == SOIL_IOCTL_BIND_CHANNEL) {
+    struct soil_channel_bind_args args;
+    if (copy_from_user(&args, (struct soil_channel_bind_args *)arg,
+                       sizeof(struct soil_channel_bind_args)) != 0) {
+      printk("Failed to copy param from user\n");
+      return -EFAULT;
+    }
+    long res = -2;
+    mutex_lock(&vmtable_lock);
+    soil_vm_t *vm = lookup_vm(args.vm);
+    if (vm != NULL) {
+      res = bind_channel(vm, args.channel, args.slot, args.end);
+    }
+    mutex_unlock(&vmtable_lock);
+    return res;
+  } else if (cmd == SOIL_IOCTL_DESTROY_CHANNEL) {
+    return destroy_channel(arg);
+  } else if (cmd == SOIL_IOCTL_NUMA_STATS) {
+    struct soil_numa_stats_args args;
+    if (copy_from_user(&args, (struct soil_numa_stats_args *)arg,
+                       sizeof(struct soil_numa_stats_args)) != 0) {
+      printk("Failed to copy param from user\n");
+      return -EFAULT;
+    }
+    struct soil_numa_stats stats;
+    long res = get_numa_stats(args.node, &stats);
+    if (res != 0) {
+      return res;
+    }
+    if (copy_to_user(args.stats, &stats, sizeof(stats)) != 0) {
+      return -EFAULT;
+    }
+    return 0;
+  } else if (cmd == SOIL_IOCTL_CREATE_SEGMENT) {
+    struct soil_segment_args args;
+    if (copy_from_user(&args, (struct soil_segment_args *)arg,
+                       sizeof(struct soil_segment_args)) != 0) {
+      printk("Failed to copy param from user\n");
+      return -EFAULT;
+    }
+    u64 handle;
+    long res = create_segment(&args, &handle);
+    if (res != 0) {
+      return res;
+    }
+    if (copy_to_user(args.segment, &handle, sizeof(handle)) != 0) {
+      destroy_segment(handle);
+      return -EFAULT;
     }
-    kfree(vm);
     return 0;
+  } else if (cmd == SOIL_IOCTL_ATTACH_SEGMENT) {
+    struct soil_segment_attach_args args;
+    if (copy_from_user(&args, (struct soil_segment_attach_args *)arg,
+                       sizeof(struct soil_segment_attach_args)) != 0) {
+      printk("Failed to copy param from user\n");
+      return -EFAULT;
+    }
+    long res = -1;
+    mutex_lock(&bintable_lock);
+    if (args.program < bintable_len && bintable[args.program].len != 0) {
+      // VMs of the program pick the segment up the next time they start.
+      res = attach_segment(&bintable[args.program].segments, args.segment,
+                           args.base, args.flags);
+    }
+    mutex_unlock(&bintable_lock);
+    return res;
+  } else if (cmd == SOIL_IOCTL_DESTROY_SEGMENT) {
+    return destroy_segment(arg);
   }
   return -ENOTTY;
 }
@@ -132,6 +581,7 @@ struct file_operations soil_fops = {
     .open = handle_open,
     .release = handle_release,
     .unlocked_ioctl = handle_ioctl,
+    .mmap = handle_mmap,
 };
 
 struct device *dev_file;
@@ -139,6 +589,15 @@ struct class *cls;
 
 static int __init init_soil_km(void) {
   printk(KERN_INFO "Hello, soil!\n");
+  init_syscall_tables();
+  init_vm_pool();
+  if (init_parking() != 0) {
+    return -ENOMEM;
+  }
+  if (init_vm_status() != 0) {
+    destroy_parking();
+    return -ENOMEM;
+  }
   int res = register_chrdev(IOC_MAGIC, "soil", &soil_fops);
   if (res != 0) {
     pr_alert("Failed to register character device %d\n", IOC_MAGIC);
@@ -154,6 +613,21 @@ static void __exit exit_soil_km(void) {
   device_destroy(cls, MKDEV(IOC_MAGIC, 0));
   class_destroy(cls);
   unregister_chrdev(IOC_MAGIC, "soil");
+  detach_all_nf_programs();
+  destroy_all_channels();
+  // Parked VMs must not wake up once the module is gone. Guest threads of
+  // paused VMs would keep running on the workqueue.
+  for (u64 i = 0; i < vmtable_len; i++) {
+    if (vmtable[i]) {
+      cancel_vm_parking(vmtable[i]);
+      if (!vm_is_busy(vmtable[i]))
+        release_guest_threads(vmtable[i]);
+    }
+  }
+  destroy_parking();
+  destroy_vm_pool();
+  destroy_all_segments();
+  destroy_vm_status();
 }
 
 module_init(init_soil_km);
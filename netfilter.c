@@ -0,0 +1,234 @@
+#include "vm.h"
+#include <linux/bottom_half.h>
+#include <linux/idr.h>
+#include <linux/kernel.h>
+#include <linux/mutex.h>
+#include <linux/netfilter.h>
+#include <linux/percpu.h>
+#include <linux/skbuff.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/uaccess.h>
+#include <net/net_namespace.h>
+
+// Soil programs attached to netfilter hooks. Every CPU gets its own VM on its
+// NUMA node that is initialized once at attach time. Between packets, only
+// the registers and the guest memory the previous packet wrote to are reset,
+// the latter from a copy of the memory image right after initialization.
+
+#define NF_DEFAULT_BUDGET 4096
+
+struct nf_program {
+  struct nf_hook_ops ops;
+  soil_vm_t *__percpu *vms;
+  struct soil_nf_stats __percpu *stats;
+  Byte *image;
+  Word image_len;
+};
+
+static DEFINE_MUTEX(nf_programs_lock);
+static DEFINE_IDR(nf_programs);
+
+// Restores a range of guest memory from the image.
+static void restore_range(struct nf_program *prog, soil_vm_t *vm, Word lo,
+                          Word hi) {
+  lo = max_t(Word, lo, 0);
+  hi = min_t(Word, hi, MEMORY_ALLOC_SIZE);
+  if (hi <= lo)
+    return;
+  Word split = clamp_t(Word, prog->image_len, lo, hi);
+  memcpy(vm->mem + lo, prog->image + lo, split - lo);
+  memset(vm->mem + split, 0, hi - split);
+}
+
+// The packet, the stack at the end of guest memory and everything else the
+// program wrote are restored separately, so that a program touching all of
+// them doesn't pay for the memory in between.
+static void reset_packet_vm(struct nf_program *prog, soil_vm_t *vm,
+                            u32 packet_len) {
+  restore_range(prog, vm, SOIL_NF_PACKET_ADDR,
+                SOIL_NF_PACKET_ADDR + packet_len);
+  restore_range(prog, vm, vm->stack_lo, vm->stack_hi);
+  restore_range(prog, vm, vm->dirty_lo, vm->dirty_hi);
+  vm->dirty_lo = MEMORY_ALLOC_SIZE;
+  vm->dirty_hi = 0;
+  vm->stack_lo = MEMORY_ALLOC_SIZE;
+  vm->stack_hi = 0;
+
+  memset(vm->reg, 0, sizeof(vm->reg));
+  vm->reg[SOIL_REG_SP] = vm->mem_size;
+  vm->ip = 0;
+  vm->call_stack_len = 0;
+  vm->try_stack_len = 0;
+  vm->exit_code = 0;
+  vm->status = SOIL_VM_INIT;
+}
+
+static unsigned int run_nf_program(void *priv, struct sk_buff *skb,
+                                   const struct nf_hook_state *state) {
+  struct nf_program *prog = priv;
+  unsigned int verdict = NF_DROP;
+
+  // Pins us to this CPU's VM and keeps softirqs from reentering it.
+  local_bh_disable();
+  soil_vm_t *vm = *this_cpu_ptr(prog->vms);
+  struct soil_nf_stats *stats = this_cpu_ptr(prog->stats);
+
+  u32 len = min_t(u32, skb->len, SOIL_NF_PACKET_MAX);
+  // Attaching made sure that the packet fits into guest memory. It isn't
+  // marked as dirty; the packet is reset on its own.
+  Byte *packet = vm->mem + SOIL_NF_PACKET_ADDR;
+  if (skb_copy_bits(skb, 0, packet, len) != 0) {
+    stats->aborts++;
+    goto out;
+  }
+  vm->reg[SOIL_REG_A] = SOIL_NF_PACKET_ADDR;
+  vm->reg[SOIL_REG_B] = len;
+
+  run(vm);
+
+  stats->instructions += vm->instructions;
+  if (vm->status != SOIL_VM_EXITED)
+    stats->aborts++;
+  else if (vm->exit_code == SOIL_NF_ACCEPT)
+    verdict = NF_ACCEPT;
+
+out:
+  stats->packets++;
+  if (verdict == NF_DROP)
+    stats->drops++;
+  reset_packet_vm(prog, vm, len);
+  local_bh_enable();
+  return verdict;
+}
+
+static void free_nf_program(struct nf_program *prog) {
+  int cpu;
+  if (prog->vms) {
+    for_each_possible_cpu(cpu) {
+      free_vm(*per_cpu_ptr(prog->vms, cpu));
+    }
+    free_percpu(prog->vms);
+  }
+  free_percpu(prog->stats);
+  kvfree(prog->image);
+  kfree(prog);
+}
+
+long attach_nf_program(struct soil_nf_attach_args *args, Byte *bin,
+                       u64 bin_len, struct soil_syscall_table *syscalls,
+                       struct soil_segment_set *segments) {
+  if (args->hook >= NF_INET_NUMHOOKS ||
+      (args->pf != NFPROTO_IPV4 && args->pf != NFPROTO_IPV6))
+    return -EINVAL;
+
+  struct nf_program *prog = kzalloc(sizeof(*prog), GFP_KERNEL);
+  if (prog == NULL)
+    return -ENOMEM;
+  prog->vms = alloc_percpu(soil_vm_t *);
+  prog->stats = alloc_percpu(struct soil_nf_stats);
+  if (prog->vms == NULL || prog->stats == NULL)
+    goto nomem;
+
+  struct soil_vm_qos qos = {
+      .instruction_budget = args->instruction_budget ?: NF_DEFAULT_BUDGET,
+  };
+  int cpu;
+  for_each_possible_cpu(cpu) {
+    soil_vm_t *vm = alloc_vm(cpu_to_node(cpu));
+    if (vm == NULL)
+      goto nomem;
+    *per_cpu_ptr(prog->vms, cpu) = vm;
+    bind_syscall_table(vm, syscalls);
+    bind_vm_segments(vm, segments);
+    set_vm_limits(vm, &qos);
+    init_vm(vm, bin, bin_len, args->flags & SOIL_EXEC_MASKED_MEMORY);
+    if (vm->status != SOIL_VM_INIT || vm->mem_size < SOIL_NF_PACKET_ADDR +
+                                                         SOIL_NF_PACKET_MAX) {
+      free_nf_program(prog);
+      return -ENOEXEC;
+    }
+    vm->flags |= SOIL_VM_ATOMIC;
+
+    if (prog->image == NULL) {
+      prog->image_len = max_t(Word, vm->dirty_hi, 0);
+      prog->image = kvmalloc(prog->image_len ?: 1, GFP_KERNEL);
+      if (prog->image == NULL)
+        goto nomem;
+      memcpy(prog->image, vm->mem, prog->image_len);
+    }
+    vm->dirty_lo = MEMORY_ALLOC_SIZE;
+    vm->dirty_hi = 0;
+    vm->stack_lo = MEMORY_ALLOC_SIZE;
+    vm->stack_hi = 0;
+  }
+
+  prog->ops.hook = run_nf_program;
+  prog->ops.priv = prog;
+  prog->ops.pf = args->pf;
+  prog->ops.hooknum = args->hook;
+  prog->ops.priority = args->priority;
+
+  mutex_lock(&nf_programs_lock);
+  int handle = idr_alloc(&nf_programs, prog, 0, 0, GFP_KERNEL);
+  int res = handle < 0 ? handle : nf_register_net_hook(&init_net, &prog->ops);
+  if (res < 0 && handle >= 0)
+    idr_remove(&nf_programs, handle);
+  mutex_unlock(&nf_programs_lock);
+  if (res < 0) {
+    free_nf_program(prog);
+    return res;
+  }
+
+  u64 uhandle = handle;
+  if (copy_to_user(args->handle, &uhandle, sizeof(uhandle)) != 0) {
+    detach_nf_program(handle);
+    return -EFAULT;
+  }
+  return 0;
+
+nomem:
+  free_nf_program(prog);
+  return -ENOMEM;
+}
+
+long detach_nf_program(u64 handle) {
+  mutex_lock(&nf_programs_lock);
+  struct nf_program *prog =
+      handle > INT_MAX ? NULL : idr_remove(&nf_programs, handle);
+  mutex_unlock(&nf_programs_lock);
+  if (prog == NULL)
+    return -ENOENT;
+  // Waits for packets that are still being processed.
+  nf_unregister_net_hook(&init_net, &prog->ops);
+  free_nf_program(prog);
+  return 0;
+}
+
+long get_nf_stats(u64 handle, struct soil_nf_stats *stats) {
+  memset(stats, 0, sizeof(*stats));
+  mutex_lock(&nf_programs_lock);
+  struct nf_program *prog =
+      handle > INT_MAX ? NULL : idr_find(&nf_programs, handle);
+  if (prog) {
+    int cpu;
+    for_each_possible_cpu(cpu) {
+      struct soil_nf_stats *s = per_cpu_ptr(prog->stats, cpu);
+      stats->packets += s->packets;
+      stats->instructions += s->instructions;
+      stats->drops += s->drops;
+      stats->aborts += s->aborts;
+    }
+  }
+  mutex_unlock(&nf_programs_lock);
+  return prog ? 0 : -ENOENT;
+}
+
+void detach_all_nf_programs(void) {
+  struct nf_program *prog;
+  int handle;
+  idr_for_each_entry(&nf_programs, prog, handle) {
+    detach_nf_program(handle);
+  }
+  idr_destroy(&nf_programs);
+}
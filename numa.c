@@ -0,0 +1,80 @@
+#include "vm.h"
+#include <linux/atomic.h>
+#include <linux/cpumask.h>
+#include <linux/kernel.h>
+#include <linux/nodemask.h>
+#include <linux/numa.h>
+#include <linux/topology.h>
+
+// Every VM belongs to a NUMA node, either one the caller picked or the one it
+// first ran on. Its guest memory and byte code are allocated there and the
+// threads the module starts for it only run on that node's CPUs. The counters
+// below show how often that works out.
+
+struct numa_stats {
+  atomic64_t runs;
+  atomic64_t remote_runs;
+  atomic64_t memory;
+};
+
+static struct numa_stats numa_stats[MAX_NUMNODES];
+
+bool valid_numa_node(s32 node) {
+  return node >= 0 && node < MAX_NUMNODES && node_online(node);
+}
+
+// Narrows mask down to the CPUs of node, leaving it untouched if there are
+// none in it.
+int restrict_cpumask_to_node(struct cpumask *mask, int node) {
+  if (!cpumask_intersects(mask, cpumask_of_node(node)))
+    return -EINVAL;
+  cpumask_and(mask, mask, cpumask_of_node(node));
+  return 0;
+}
+
+// Decides the node of a VM before a run. mask holds the CPUs an async run may
+// use and is restricted to the node; it is NULL for synchronous runs.
+int place_vm(soil_vm_t *vm, u8 flags, const struct soil_vm_qos *qos,
+             struct cpumask *mask) {
+  if (flags & SOIL_EXEC_NUMA_NODE) {
+    if (!valid_numa_node(qos->numa_node))
+      return -EINVAL;
+    if (mask && restrict_cpumask_to_node(mask, qos->numa_node) != 0)
+      return -EINVAL;
+    vm->numa_node = qos->numa_node;
+    return 0;
+  }
+  if (vm->numa_node == NUMA_NO_NODE) {
+    int node = numa_node_id();
+    if (mask && !cpumask_intersects(mask, cpumask_of_node(node)))
+      node = cpu_to_node(cpumask_first(mask));
+    vm->numa_node = node;
+  }
+  // A VM that merely followed its first run may still run elsewhere if the
+  // CPU mask of a later run excludes its node.
+  if (mask)
+    restrict_cpumask_to_node(mask, vm->numa_node);
+  return 0;
+}
+
+void count_vm_run(soil_vm_t *vm) {
+  if (vm->numa_node == NUMA_NO_NODE)
+    return;
+  atomic64_inc(&numa_stats[vm->numa_node].runs);
+  if (numa_node_id() != vm->numa_node)
+    atomic64_inc(&numa_stats[vm->numa_node].remote_runs);
+}
+
+void account_numa_memory(int node, s64 bytes) {
+  if (node != NUMA_NO_NODE)
+    atomic64_add(bytes, &numa_stats[node].memory);
+}
+
+long get_numa_stats(s32 node, struct soil_numa_stats *stats) {
+  if (!valid_numa_node(node))
+    return -EINVAL;
+  stats->runs = atomic64_read(&numa_stats[node].runs);
+  stats->remote_runs = atomic64_read(&numa_stats[node].remote_runs);
+  stats->memory = atomic64_read(&numa_stats[node].memory);
+  return 0;
+}
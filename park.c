@@ -0,0 +1,306 @@
+#include "vm.h"
+#include <linux/export.h>
+#include <linux/hrtimer.h>
+#include <linux/cpu.h>
+#include <linux/cpumask.h>
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/topology.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+
+// Syscalls that would block park the VM instead. The handler moves the VM
+// from RUNNING to PARKING and starts the operation; the interpreter then
+// leaves its loop after the syscall instruction and the thread running it
+// moves the VM on to PARKED and goes on with other work. Whoever completes the
+// operation calls soil_vm_unpark. If that happens before the thread let go of
+// the VM, the VM simply continues on that thread. Otherwise, it continues on
+// the soil workqueue, so waiting VMs don't hold on to a thread each.
+//
+//   RUNNING --park--> PARKING --run loop exits--> PARKED --unpark--> RUNNING
+//                        |                                             ^
+//                        +-------------------unpark--------------------+
+//
+// Runs with a CPU mask or priority resume on a workqueue whose workers have
+// the same CPU mask and nice level, shared by all runs asking for the same.
+// Workqueues have no real-time class, so real-time runs resume at the highest
+// nice level instead. While a VM with a deadline is parked, a timer unparks
+// it once the deadline passed and the VM stops right away.
+
+struct soil_resume_wq {
+  struct list_head node;
+  struct workqueue_attrs *attrs;
+  struct workqueue_struct *wq;
+  int users;
+};
+
+static struct workqueue_struct *soil_wq;
+static LIST_HEAD(resume_wqs);
+static DEFINE_MUTEX(resume_wqs_lock);
+static DECLARE_WAIT_QUEUE_HEAD(vm_stopped);
+
+#define REGA ((vm)->reg[SOIL_REG_A])
+
+static bool vm_in_flight(soil_vm_t *vm) {
+  soil_vm_status_t status = READ_ONCE(vm->status);
+  return status == SOIL_VM_RUNNING || status == SOIL_VM_PAUSING ||
+         status == SOIL_VM_PARKING || status == SOIL_VM_PARKED;
+}
+
+static void resume_parked_vm(struct work_struct *work) {
+  soil_vm_t *vm = container_of(work, soil_vm_t, resume_work);
+  // The deadline isn't checked while the VM is parked.
+  if (vm->deadline != 0 && ktime_get_ns() >= vm->deadline &&
+      cmpxchg(&vm->status, SOIL_VM_RUNNING, SOIL_VM_DEADLINE_EXCEEDED) ==
+          SOIL_VM_RUNNING) {
+    printk(KERN_INFO "deadline exceeded while parked\n");
+    hrtimer_try_to_cancel(&vm->sleep_timer);
+  }
+  continue_vm(vm);
+  // Guest threads only ever run here. Once one has stopped, whoever joins it
+  // may free it.
+  if (is_stopped_guest_thread(vm))
+    guest_thread_stopped(vm);
+}
+
+static enum hrtimer_restart wake_sleeping_vm(struct hrtimer *timer) {
+  soil_vm_t *vm = container_of(timer, soil_vm_t, sleep_timer);
+  soil_vm_unpark(vm);
+  return HRTIMER_NORESTART;
+}
+
+// Armed until the VM stops for good. If the VM is running when it fires, it
+// notices the deadline itself.
+static enum hrtimer_restart wake_vm_at_deadline(struct hrtimer *timer) {
+  soil_vm_t *vm = container_of(timer, soil_vm_t, deadline_timer);
+  soil_vm_unpark(vm);
+  return HRTIMER_NORESTART;
+}
+
+void init_vm_parking(soil_vm_t *vm) {
+  INIT_WORK(&vm->resume_work, resume_parked_vm);
+  hrtimer_setup(&vm->sleep_timer, wake_sleeping_vm, CLOCK_MONOTONIC,
+                HRTIMER_MODE_REL);
+  hrtimer_setup(&vm->deadline_timer, wake_vm_at_deadline, CLOCK_MONOTONIC,
+                HRTIMER_MODE_ABS);
+}
+
+static void put_resume_wq(struct soil_resume_wq *rwq) {
+  if (rwq == NULL)
+    return;
+  mutex_lock(&resume_wqs_lock);
+  bool last = --rwq->users == 0;
+  if (last)
+    list_del(&rwq->node);
+  mutex_unlock(&resume_wqs_lock);
+  if (!last)
+    return;
+  destroy_workqueue(rwq->wq);
+  free_workqueue_attrs(rwq->attrs);
+  kfree(rwq);
+}
+
+// Returns the workqueue for the given CPU mask and nice level, creating it if
+// no run uses it yet.
+static struct soil_resume_wq *get_resume_wq(const struct cpumask *mask,
+                                            int nice) {
+  struct soil_resume_wq *rwq;
+  mutex_lock(&resume_wqs_lock);
+  list_for_each_entry(rwq, &resume_wqs, node) {
+    if (rwq->attrs->nice == nice && cpumask_equal(rwq->attrs->cpumask, mask)) {
+      rwq->users++;
+      mutex_unlock(&resume_wqs_lock);
+      return rwq;
+    }
+  }
+
+  rwq = kzalloc(sizeof(*rwq), GFP_KERNEL);
+  if (rwq == NULL)
+    goto fail;
+  rwq->attrs = alloc_workqueue_attrs();
+  if (rwq->attrs == NULL)
+    goto fail;
+  rwq->attrs->nice = nice;
+  cpumask_copy(rwq->attrs->cpumask, mask);
+  rwq->wq = alloc_workqueue("soil_qos", WQ_UNBOUND, 0);
+  if (rwq->wq == NULL)
+    goto fail;
+  cpus_read_lock();
+  int res = apply_workqueue_attrs(rwq->wq, rwq->attrs);
+  cpus_read_unlock();
+  if (res != 0)
+    goto fail;
+  rwq->users = 1;
+  list_add(&rwq->node, &resume_wqs);
+  mutex_unlock(&resume_wqs_lock);
+  return rwq;
+
+fail:
+  mutex_unlock(&resume_wqs_lock);
+  if (rwq) {
+    if (rwq->wq)
+      destroy_workqueue(rwq->wq);
+    free_workqueue_attrs(rwq->attrs);
+    kfree(rwq);
+  }
+  return NULL;
+}
+
+// Makes the VM resume with the CPU mask and priority of its run. Without
+// QoS, the VM resumes on the default workqueue. Must not be called while the
+// VM may park.
+int bind_vm_resume_qos(soil_vm_t *vm, const struct soil_vm_qos *qos,
+                       const struct cpumask *mask) {
+  struct soil_resume_wq *rwq = NULL;
+  if (qos && (qos->cpu_mask || qos->nice != 0 ||
+              qos->priority_class == SOIL_PRIO_REALTIME)) {
+    int nice = qos->priority_class == SOIL_PRIO_REALTIME
+                   ? MIN_NICE
+                   : clamp_t(int, qos->nice, MIN_NICE, MAX_NICE);
+    rwq = get_resume_wq(mask, nice);
+    if (rwq == NULL)
+      return -ENOMEM;
+  }
+  put_resume_wq(vm->resume_wq);
+  vm->resume_wq = rwq;
+  return 0;
+}
+
+// Guest threads resume like the VM that spawned them.
+void share_vm_resume_qos(soil_vm_t *vm, soil_vm_t *from) {
+  struct soil_resume_wq *rwq = from->resume_wq;
+  if (rwq) {
+    mutex_lock(&resume_wqs_lock);
+    rwq->users++;
+    mutex_unlock(&resume_wqs_lock);
+  }
+  put_resume_wq(vm->resume_wq);
+  vm->resume_wq = rwq;
+}
+
+// VMs in atomic context have no thread to give up and no workqueue to come
+// back on.
+bool soil_vm_can_park(soil_vm_t *vm) {
+  return !(vm->flags & SOIL_VM_ATOMIC);
+}
+EXPORT_SYMBOL_GPL(soil_vm_can_park);
+
+// Parks the VM after the current syscall. The handler stores results in the
+// registers before calling soil_vm_unpark.
+void soil_vm_park(soil_vm_t *vm) {
+  cmpxchg(&vm->status, SOIL_VM_RUNNING, SOIL_VM_PARKING);
+}
+EXPORT_SYMBOL_GPL(soil_vm_park);
+
+// Parks the VM in front of the current syscall, which runs again once the VM
+// is unparked. Handlers waiting for a condition use this to check it again.
+void soil_vm_park_restart(soil_vm_t *vm) {
+  vm->ip -= 2;
+  soil_vm_park(vm);
+}
+EXPORT_SYMBOL_GPL(soil_vm_park_restart);
+
+// Can be called from any context, including hard interrupts.
+void soil_vm_unpark(soil_vm_t *vm) {
+  if (cmpxchg(&vm->status, SOIL_VM_PARKING, SOIL_VM_RUNNING) ==
+      SOIL_VM_PARKING)
+    return;
+  if (cmpxchg(&vm->status, SOIL_VM_PARKED, SOIL_VM_RUNNING) ==
+      SOIL_VM_PARKED) {
+    struct workqueue_struct *wq = vm->resume_wq ? vm->resume_wq->wq : soil_wq;
+    if (vm->numa_node != NUMA_NO_NODE)
+      queue_work_node(vm->numa_node, wq, &vm->resume_work);
+    else
+      queue_work(wq, &vm->resume_work);
+  }
+}
+EXPORT_SYMBOL_GPL(soil_vm_unpark);
+
+// Called by the thread running the VM once it has left the run loop. Returns
+// true if the VM was unparked in the meantime and should keep running.
+bool finish_parking(soil_vm_t *vm) {
+  // Armed while the VM still belongs to this thread, so that it can't race
+  // with the VM's next park.
+  if (vm->deadline != 0 && READ_ONCE(vm->status) == SOIL_VM_PARKING)
+    hrtimer_start(&vm->deadline_timer, ns_to_ktime(vm->deadline),
+                  HRTIMER_MODE_ABS);
+  soil_vm_status_t old =
+      cmpxchg(&vm->status, SOIL_VM_PARKING, SOIL_VM_PARKED);
+  if (old == SOIL_VM_RUNNING)
+    return true;
+  if (old != SOIL_VM_PARKING) {
+    // The VM stopped, so nothing may wake it anymore.
+    if (vm->deadline != 0)
+      hrtimer_cancel(&vm->deadline_timer);
+    vm_runner_done(vm);
+  }
+  return false;
+}
+
+// Called by the thread running the VM once it won't touch the VM anymore.
+void vm_runner_done(soil_vm_t *vm) {
+  smp_store_release(&vm->running, false);
+  wake_up_all(&vm_stopped);
+}
+
+// Waits for the thread that stopped the VM to let go of it, so that it no
+// longer writes to the VM's status entry. Only the tail of continue_vm is left
+// by then, so this doesn't wait for long.
+void wait_for_runner(soil_vm_t *vm) {
+  wait_event(vm_stopped, !smp_load_acquire(&vm->running));
+}
+
+// Waits until a VM that may have parked has finished and the worker that ran
+// it last let go of it. Returns -EINTR if the caller was killed first; the VM
+// then finishes on its own.
+int wait_for_vm(soil_vm_t *vm) {
+  int res = wait_event_killable(vm_stopped, !vm_in_flight(vm));
+  if (res == 0)
+    flush_work(&vm->resume_work);
+  return res;
+}
+
+void syscall_sleep(soil_vm_t *vm) {
+  if (REGA <= 0)
+    return;
+  if (!soil_vm_can_park(vm)) {
+    soil_vm_panic(vm, "sleep is not supported in atomic context");
+    return;
+  }
+  soil_vm_park(vm);
+  hrtimer_start(&vm->sleep_timer, ns_to_ktime(REGA), HRTIMER_MODE_REL);
+}
+
+void cancel_vm_parking(soil_vm_t *vm) {
+  hrtimer_cancel(&vm->sleep_timer);
+  hrtimer_cancel(&vm->deadline_timer);
+  cancel_work_sync(&vm->resume_work);
+}
+
+// Stops a VM that may still be parked or running on the workqueue, for owners
+// that can't wait for it to finish. Once this returns, nothing runs the VM
+// anymore and it can be released.
+void stop_vm(soil_vm_t *vm) {
+  for (;;) {
+    soil_vm_status_t status = READ_ONCE(vm->status);
+    if (status != SOIL_VM_RUNNING && status != SOIL_VM_PAUSING &&
+        status != SOIL_VM_PARKING && status != SOIL_VM_PARKED)
+      break;
+    if (cmpxchg(&vm->status, status, SOIL_VM_EXITED) == status)
+      break;
+  }
+  // Unparking an exited VM does nothing, so the work can't be queued again.
+  cancel_vm_parking(vm);
+  wake_up_all(&vm_stopped);
+}
+
+int init_parking(void) {
+  soil_wq = alloc_workqueue("soil", WQ_UNBOUND, 0);
+  return soil_wq ? 0 : -ENOMEM;
+}
+
+void destroy_parking(void) { destroy_workqueue(soil_wq); }
@@ -0,0 +1,162 @@
+#include "vm.h"
+#include <linux/cpumask.h>
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/numa.h>
+#include <linux/percpu.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/topology.h>
+#include <linux/workqueue.h>
+
+// Every CPU keeps a small cache of VMs. Deleted VMs are parked on the dirty
+// list and a work item bound to the same CPU zeroes the guest memory they
+// wrote to before moving them to the clean list, so creating a VM usually
+// neither touches the allocator nor pays for clearing a megabyte of memory.
+// VMs placed on a remote NUMA node go to and come from the pool of a CPU on
+// that node instead, so their memory is scrubbed where it lives.
+
+#define VM_POOL_SIZE 8
+
+struct vm_pool {
+  spinlock_t lock;
+  struct list_head clean;
+  struct list_head dirty;
+  unsigned int len;
+  int cpu;
+  struct work_struct scrub;
+};
+
+static DEFINE_PER_CPU(struct vm_pool, vm_pools);
+
+// Locks the pool of this CPU, or that of a CPU on node if it is a remote one.
+static struct vm_pool *lock_pool(int node) {
+  int cpu = get_cpu();
+  if (node != NUMA_NO_NODE && node != cpu_to_node(cpu)) {
+    int remote = cpumask_any_and(cpumask_of_node(node), cpu_online_mask);
+    if (remote < nr_cpu_ids)
+      cpu = remote;
+  }
+  struct vm_pool *pool = per_cpu_ptr(&vm_pools, cpu);
+  spin_lock(&pool->lock);
+  return pool;
+}
+
+static void unlock_pool(struct vm_pool *pool) {
+  spin_unlock(&pool->lock);
+  put_cpu();
+}
+
+static soil_vm_t *pop_vm(struct list_head *list) {
+  soil_vm_t *vm = list_first_entry_or_null(list, soil_vm_t, pool_node);
+  if (vm)
+    list_del(&vm->pool_node);
+  return vm;
+}
+
+static void scrub_vm_pool(struct work_struct *work) {
+  struct vm_pool *pool = container_of(work, struct vm_pool, scrub);
+  for (;;) {
+    // The VM stays counted in pool->len while it is being scrubbed.
+    spin_lock(&pool->lock);
+    soil_vm_t *vm = pop_vm(&pool->dirty);
+    spin_unlock(&pool->lock);
+    if (vm == NULL)
+      break;
+
+    clear_vm_memory(vm);
+
+    spin_lock(&pool->lock);
+    list_add(&vm->pool_node, &pool->clean);
+    spin_unlock(&pool->lock);
+    cond_resched();
+  }
+}
+
+// Returns a VM placed on node, or one that follows its first run for
+// NUMA_NO_NODE.
+soil_vm_t *pool_get_vm(int node) {
+  bool dirty = false;
+  struct vm_pool *pool = lock_pool(node);
+  soil_vm_t *vm = pop_vm(&pool->clean);
+  if (vm == NULL) {
+    vm = pop_vm(&pool->dirty);
+    dirty = vm != NULL;
+  }
+  if (vm)
+    pool->len--;
+  unlock_pool(pool);
+
+  if (vm == NULL)
+    return alloc_vm(node);
+  // The scrubber hasn't gotten to this one yet, so clear it ourselves.
+  if (dirty)
+    clear_vm_memory(vm);
+  // Nothing of the previous tenant's run may show up in the status page.
+  vm->status = SOIL_VM_INIT;
+  vm->exit_code = 0;
+  vm->instructions = 0;
+  vm->started_ns = 0;
+  vm->stopped_ns = 0;
+  vm->numa_node = node;
+  return vm;
+}
+
+void pool_put_vm(soil_vm_t *vm) {
+  if (vm == NULL)
+    return;
+  // The worker that resumed the VM last may still be on its way out, and a
+  // timer of its last run may still be armed.
+  cancel_vm_parking(vm);
+  vm->running = false;
+  deinit_vm(vm);
+  vm->idx = -1;
+  // Don't keep the modules providing the old program's syscalls pinned.
+  bind_syscall_table(vm, builtin_syscall_table());
+  bind_vm_segments(vm, NULL);
+  bind_vm_resume_qos(vm, NULL, NULL);
+  release_vm_channels(vm);
+
+  struct vm_pool *pool = lock_pool(vm->mem_node);
+  if (pool->len < VM_POOL_SIZE) {
+    if (vm->dirty_hi > vm->dirty_lo || vm->stack_hi > vm->stack_lo) {
+      list_add_tail(&vm->pool_node, &pool->dirty);
+      queue_work_on(pool->cpu, system_wq, &pool->scrub);
+    } else {
+      list_add(&vm->pool_node, &pool->clean);
+    }
+    pool->len++;
+    vm = NULL;
+  }
+  unlock_pool(pool);
+
+  // The pool is full.
+  free_vm(vm);
+}
+
+void init_vm_pool(void) {
+  int cpu;
+  for_each_possible_cpu(cpu) {
+    struct vm_pool *pool = per_cpu_ptr(&vm_pools, cpu);
+    spin_lock_init(&pool->lock);
+    INIT_LIST_HEAD(&pool->clean);
+    INIT_LIST_HEAD(&pool->dirty);
+    pool->len = 0;
+    pool->cpu = cpu;
+    INIT_WORK(&pool->scrub, scrub_vm_pool);
+  }
+}
+
+void destroy_vm_pool(void) {
+  int cpu;
+  for_each_possible_cpu(cpu) {
+    struct vm_pool *pool = per_cpu_ptr(&vm_pools, cpu);
+    cancel_work_sync(&pool->scrub);
+    soil_vm_t *vm;
+    while ((vm = pop_vm(&pool->clean)))
+      free_vm(vm);
+    while ((vm = pop_vm(&pool->dirty)))
+      free_vm(vm);
+    pool->len = 0;
+  }
+}
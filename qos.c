@@ -0,0 +1,40 @@
+#include "vm.h"
+#include <linux/cpumask.h>
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/sched.h>
+#include <linux/uaccess.h>
+
+// Limits enforced by the interpreter. The memory cap takes effect in init_vm,
+// so this has to be called before it.
+void set_vm_limits(soil_vm_t *vm, const struct soil_vm_qos *qos) {
+  vm->instruction_budget = qos->instruction_budget ?: U64_MAX;
+  vm->deadline = qos->deadline_ns ? ktime_get_ns() + qos->deadline_ns : 0;
+  vm->memory_cap = qos->memory_cap;
+}
+
+// Copies the CPU mask of a run from user space, restricted to online CPUs.
+// Without a mask, any online CPU may be used.
+int copy_qos_cpumask(const struct soil_vm_qos *qos, struct cpumask *mask) {
+  if (qos->cpu_mask == NULL) {
+    cpumask_copy(mask, cpu_online_mask);
+    return 0;
+  }
+  cpumask_clear(mask);
+  u32 len = min_t(u32, qos->cpu_mask_len, cpumask_size());
+  if (copy_from_user(cpumask_bits(mask), qos->cpu_mask, len) != 0)
+    return -EFAULT;
+  cpumask_and(mask, mask, cpu_online_mask);
+  if (cpumask_empty(mask))
+    return -EINVAL;
+  return 0;
+}
+
+void apply_task_priority(struct task_struct *task,
+                         const struct soil_vm_qos *qos) {
+  if (qos->priority_class == SOIL_PRIO_REALTIME) {
+    sched_set_fifo_low(task);
+    return;
+  }
+  set_user_nice(task, clamp_t(int, qos->nice, MIN_NICE, MAX_NICE));
+}
@@ -0,0 +1,295 @@
+#include "vm.h"
+#include <linux/idr.h>
+#include <linux/kernel.h>
+#include <linux/kref.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/uaccess.h>
+
+// Shared segments are read-only blobs that many VMs see at the same guest
+// address without each of them holding a copy. They are attached to a program
+// at an address behind guest memory, so the interpreter only reaches them
+// through the slow path for accesses that fail the range check, and syscalls
+// through soil_guest_ptr for ranges they only read. Masked VMs wrap every
+// address into guest memory and never see them.
+//
+// Like syscall tables, the segments of a program form an immutable set that
+// VMs bind to when they start. Attaching a segment replaces the program's set
+// and leaves VMs that are already running alone.
+//
+// Segments attached with SOIL_SEGMENT_COPY_ON_WRITE accept stores: the first
+// store to a page gives the VM its own copy of that page, which it keeps until
+// it is initialized again.
+
+#define SEGMENT_PAGE_SIZE 4096
+#define SEGMENT_MAX_SIZE (1024 * 1024 * 1024)
+
+struct soil_segment {
+  struct kref ref;
+  Byte *data;
+  u64 len;
+};
+
+struct segment_mapping {
+  Word base;
+  struct soil_segment *segment;
+  u8 flags;
+};
+
+struct soil_segment_set {
+  struct kref ref;
+  int len;
+  struct segment_mapping mappings[SOIL_MAX_SEGMENTS];
+};
+
+static DEFINE_MUTEX(segments_lock);
+static DEFINE_IDR(segments);
+
+static void free_segment(struct kref *ref) {
+  struct soil_segment *seg = container_of(ref, struct soil_segment, ref);
+  kvfree(seg->data);
+  kfree(seg);
+}
+
+static void free_segment_set(struct kref *ref) {
+  struct soil_segment_set *set =
+      container_of(ref, struct soil_segment_set, ref);
+  for (int i = 0; i < set->len; i++)
+    kref_put(&set->mappings[i].segment->ref, free_segment);
+  kfree(set);
+}
+
+struct soil_segment_set *get_segment_set(struct soil_segment_set *set) {
+  if (set)
+    kref_get(&set->ref);
+  return set;
+}
+
+void put_segment_set(struct soil_segment_set *set) {
+  if (set)
+    kref_put(&set->ref, free_segment_set);
+}
+
+long create_segment(struct soil_segment_args *args, u64 *handle) {
+  if (args->data == NULL || args->len == 0 || args->len > SEGMENT_MAX_SIZE)
+    return -EINVAL;
+
+  struct soil_segment *seg = kzalloc(sizeof(*seg), GFP_KERNEL);
+  if (seg == NULL)
+    return -ENOMEM;
+  kref_init(&seg->ref);
+  seg->len = args->len;
+  seg->data = kvmalloc(seg->len, GFP_KERNEL);
+  if (seg->data == NULL) {
+    kfree(seg);
+    return -ENOMEM;
+  }
+  if (copy_from_user(seg->data, args->data, seg->len) != 0) {
+    kref_put(&seg->ref, free_segment);
+    return -EFAULT;
+  }
+
+  mutex_lock(&segments_lock);
+  int id = idr_alloc(&segments, seg, 0, 0, GFP_KERNEL);
+  mutex_unlock(&segments_lock);
+  if (id < 0) {
+    kref_put(&seg->ref, free_segment);
+    return id;
+  }
+  *handle = id;
+  return 0;
+}
+
+// Replaces *set with a copy that also maps the segment at base.
+long attach_segment(struct soil_segment_set **set, u64 handle, Word base,
+                    u8 flags) {
+  struct soil_segment_set *old = *set;
+  if (old && old->len == SOIL_MAX_SEGMENTS)
+    return -ENOSPC;
+
+  struct soil_segment_set *new = kzalloc(sizeof(*new), GFP_KERNEL);
+  if (new == NULL)
+    return -ENOMEM;
+  kref_init(&new->ref);
+
+  long res = 0;
+  mutex_lock(&segments_lock);
+  struct soil_segment *seg =
+      handle > INT_MAX ? NULL : idr_find(&segments, handle);
+  if (seg == NULL) {
+    res = -ENOENT;
+  } else if (base < MEMORY_SIZE || base > S64_MAX - (Word)seg->len) {
+    res = -EINVAL;
+  } else {
+    for (int i = 0; old && i < old->len; i++) {
+      struct segment_mapping *m = &old->mappings[i];
+      if (base < m->base + (Word)m->segment->len &&
+          m->base < base + (Word)seg->len)
+        res = -EBUSY;
+      new->mappings[new->len++] = *m;
+      kref_get(&m->segment->ref);
+    }
+    kref_get(&seg->ref);
+    new->mappings[new->len++] = (struct segment_mapping){
+        .base = base,
+        .segment = seg,
+        .flags = flags,
+    };
+  }
+  mutex_unlock(&segments_lock);
+
+  if (res != 0) {
+    put_segment_set(new);
+    return res;
+  }
+  *set = new;
+  put_segment_set(old);
+  return 0;
+}
+
+static void release_cow_pages(soil_vm_t *vm) {
+  for (int i = 0; i < SOIL_MAX_SEGMENTS; i++) {
+    Byte **pages = vm->cow_pages[i];
+    if (pages == NULL)
+      continue;
+    u64 count = DIV_ROUND_UP(vm->segments->mappings[i].segment->len,
+                             SEGMENT_PAGE_SIZE);
+    for (u64 page = 0; page < count; page++)
+      kfree(pages[page]);
+    kvfree(pages);
+    vm->cow_pages[i] = NULL;
+  }
+}
+
+// Drops the pages the VM copied on write.
+void reset_vm_segments(soil_vm_t *vm) {
+  if (vm->segments)
+    release_cow_pages(vm);
+}
+
+void bind_vm_segments(soil_vm_t *vm, struct soil_segment_set *set) {
+  reset_vm_segments(vm);
+  if (set)
+    kref_get(&set->ref);
+  put_segment_set(vm->segments);
+  vm->segments = set;
+}
+
+// Returns the index of the mapping containing [addr, addr + len), or -1.
+static int find_mapping(soil_vm_t *vm, Word addr, Word len) {
+  struct soil_segment_set *set = vm->segments;
+  for (int i = 0; set && i < set->len; i++) {
+    struct segment_mapping *m = &set->mappings[i];
+    if (addr >= m->base && (u64)(addr - m->base) <= m->segment->len &&
+        (u64)len <= m->segment->len - (addr - m->base))
+      return i;
+  }
+  return -1;
+}
+
+// Copies len bytes at guest address addr out of a segment. Fails with -EFAULT
+// if the range isn't inside one.
+int read_segment(soil_vm_t *vm, Word addr, void *dst, Word len) {
+  int i = find_mapping(vm, addr, len);
+  if (i < 0)
+    return -EFAULT;
+  struct segment_mapping *m = &vm->segments->mappings[i];
+  u64 off = addr - m->base;
+  while (len > 0) {
+    u64 page = off / SEGMENT_PAGE_SIZE;
+    u64 n = min_t(u64, len, SEGMENT_PAGE_SIZE - off % SEGMENT_PAGE_SIZE);
+    const Byte *src = m->segment->data + off;
+    if (vm->cow_pages[i] && vm->cow_pages[i][page])
+      src = vm->cow_pages[i][page] + off % SEGMENT_PAGE_SIZE;
+    memcpy(dst, src, n);
+    dst = (Byte *)dst + n;
+    off += n;
+    len -= n;
+  }
+  return 0;
+}
+
+// Returns where syscalls can read len bytes at guest address addr inside a
+// segment, or NULL. Pages the VM copied on write aren't contiguous with the
+// rest, so ranges touching one are only found if they stay within the page.
+Byte *segment_ptr(soil_vm_t *vm, Word addr, Word len) {
+  int i = find_mapping(vm, addr, len);
+  if (i < 0)
+    return NULL;
+  struct segment_mapping *m = &vm->segments->mappings[i];
+  u64 off = addr - m->base;
+  Byte **copies = vm->cow_pages[i];
+  if (copies == NULL || len == 0)
+    return m->segment->data + off;
+  u64 first = off / SEGMENT_PAGE_SIZE;
+  u64 last = (off + len - 1) / SEGMENT_PAGE_SIZE;
+  if (first == last && copies[first])
+    return copies[first] + off % SEGMENT_PAGE_SIZE;
+  for (u64 page = first; page <= last; page++)
+    if (copies[page])
+      return NULL;
+  return m->segment->data + off;
+}
+
+// Copies len bytes into a segment, copying the pages they land on first. Fails
+// with -EFAULT outside of segments and -EACCES for read-only ones.
+int write_segment(soil_vm_t *vm, Word addr, const void *src, Word len) {
+  int i = find_mapping(vm, addr, len);
+  if (i < 0)
+    return -EFAULT;
+  struct segment_mapping *m = &vm->segments->mappings[i];
+  // Copying pages isn't possible in atomic context and pages copied while
+  // handling one packet would leak into the next one. Guest threads would
+  // each get a copy of their own, so they can only read.
+  if (!(m->flags & SOIL_SEGMENT_COPY_ON_WRITE) ||
+      (vm->flags & SOIL_VM_ATOMIC) || vm->tid != 0)
+    return -EACCES;
+  if (vm->cow_pages[i] == NULL) {
+    vm->cow_pages[i] = kvcalloc(
+        DIV_ROUND_UP(m->segment->len, SEGMENT_PAGE_SIZE), sizeof(Byte *),
+        GFP_KERNEL);
+    if (vm->cow_pages[i] == NULL)
+      return -ENOMEM;
+  }
+  u64 off = addr - m->base;
+  while (len > 0) {
+    u64 page = off / SEGMENT_PAGE_SIZE;
+    u64 n = min_t(u64, len, SEGMENT_PAGE_SIZE - off % SEGMENT_PAGE_SIZE);
+    Byte **copy = &vm->cow_pages[i][page];
+    if (*copy == NULL) {
+      u64 page_len = min_t(u64, SEGMENT_PAGE_SIZE,
+                           m->segment->len - page * SEGMENT_PAGE_SIZE);
+      *copy = kmemdup(m->segment->data + page * SEGMENT_PAGE_SIZE, page_len,
+                      GFP_KERNEL);
+      if (*copy == NULL)
+        return -ENOMEM;
+    }
+    memcpy(*copy + off % SEGMENT_PAGE_SIZE, src, n);
+    src = (const Byte *)src + n;
+    off += n;
+    len -= n;
+  }
+  return 0;
+}
+
+long destroy_segment(u64 handle) {
+  mutex_lock(&segments_lock);
+  struct soil_segment *seg =
+      handle > INT_MAX ? NULL : idr_remove(&segments, handle);
+  mutex_unlock(&segments_lock);
+  if (seg == NULL)
+    return -ENOENT;
+  // Programs it is attached to keep it alive.
+  kref_put(&seg->ref, free_segment);
+  return 0;
+}
+
+void destroy_all_segments(void) {
+  struct soil_segment *seg;
+  int handle;
+  idr_for_each_entry(&segments, seg, handle) {
+    destroy_segment(handle);
+  }
+  idr_destroy(&segments);
+}
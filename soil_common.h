@@ -14,6 +14,16 @@ typedef enum {
   SOIL_VM_INIT,
   SOIL_VM_RUNNING,
   SOIL_VM_EXITED,
+  SOIL_VM_PAUSING,
+  SOIL_VM_PAUSED,
+  SOIL_VM_BUDGET_EXCEEDED,
+  SOIL_VM_DEADLINE_EXCEEDED,
+  SOIL_VM_MEMORY_EXCEEDED,
+  // Waiting for a syscall to complete, without holding on to a thread.
+  SOIL_VM_PARKING,
+  SOIL_VM_PARKED,
+  // Claimed by SOIL_IOCTL_RUN, about to run.
+  SOIL_VM_STARTING,
 } soil_vm_status_t;
 
 struct soil_program {
@@ -23,11 +33,44 @@ struct soil_program {
 };
 
 #define SOIL_EXEC_ASYNC 1
+// Guest memory is a power of two in size and addresses wrap around instead
+// of being range checked.
+#define SOIL_EXEC_MASKED_MEMORY 2
+// Continue a paused or restored VM instead of starting the program afresh.
+#define SOIL_EXEC_RESUME 4
+// Place the VM on qos.numa_node. Otherwise, a VM stays on the node it first
+// ran on.
+#define SOIL_EXEC_NUMA_NODE 8
+
+#define SOIL_PRIO_NORMAL 0
+#define SOIL_PRIO_REALTIME 1
+
+// Limits for a run. Zero means unlimited for the budget, deadline and memory
+// cap. The CPU mask and priority only apply to threads the module starts, that
+// is async and batch runs, and to the workers they resume on after parking;
+// synchronous runs execute on the calling thread. Real-time runs resume at the
+// highest nice level.
+struct soil_vm_qos {
+  const unsigned long *cpu_mask;
+  uint32_t cpu_mask_len;
+  uint32_t priority_class;
+  int32_t nice;
+  uint64_t instruction_budget;
+  uint64_t deadline_ns;
+  uint64_t memory_cap;
+  int32_t numa_node;
+};
+
+struct soil_vm_create_args {
+  int32_t numa_node;
+  soil_vm_idx *vm;
+};
 
 struct soil_vm_run_args {
   soil_program_idx program;
   soil_vm_idx vm;
   uint8_t flags;
+  struct soil_vm_qos qos;
 };
 
 struct soil_vm_status_args {
@@ -35,6 +78,199 @@ struct soil_vm_status_args {
   soil_vm_status_t *status;
 };
 
+// The status of the VM in each VM table slot is published in an array of
+// SOIL_MAX_VMS entries that can be mapped read-only with mmap on /dev/soil.
+// seq is odd while an entry is being updated; read it before and after the
+// other fields and retry if it was odd or changed in between.
+#define SOIL_MAX_VMS 1024
+
+struct soil_vm_status_entry {
+  uint32_t seq;
+  uint32_t status;
+  int64_t exit_code;
+  uint64_t instructions;
+  uint64_t started_ns;
+  uint64_t stopped_ns;
+  uint64_t reserved[3];
+};
+
+// Copies a consistent snapshot of a mapped status entry.
+static inline void soil_read_vm_status(const struct soil_vm_status_entry *entry,
+                                       struct soil_vm_status_entry *out) {
+  uint32_t seq;
+  do {
+    seq = __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE);
+    out->status = __atomic_load_n(&entry->status, __ATOMIC_RELAXED);
+    out->exit_code = __atomic_load_n(&entry->exit_code, __ATOMIC_RELAXED);
+    out->instructions = __atomic_load_n(&entry->instructions, __ATOMIC_RELAXED);
+    out->started_ns = __atomic_load_n(&entry->started_ns, __ATOMIC_RELAXED);
+    out->stopped_ns = __atomic_load_n(&entry->stopped_ns, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  } while ((seq & 1) || __atomic_load_n(&entry->seq, __ATOMIC_RELAXED) != seq);
+  out->seq = seq;
+}
+
+struct soil_vm_checkpoint_args {
+  soil_vm_idx vm;
+  Byte *buf;
+  uint64_t cap;
+  uint64_t *len;
+};
+
+struct soil_vm_restore_args {
+  soil_vm_idx vm;
+  Byte *buf;
+  uint64_t len;
+};
+
+// Programs attached to a netfilter hook run once per packet. The packet is
+// copied to SOIL_NF_PACKET_ADDR and the program starts with its address in
+// register a and its length in register b. Exiting with SOIL_NF_ACCEPT lets
+// the packet pass; any other exit, a panic or running out of budget drops it.
+#define SOIL_NF_PACKET_ADDR 0x80000
+#define SOIL_NF_PACKET_MAX 0x10000
+#define SOIL_NF_ACCEPT 0
+
+struct soil_nf_attach_args {
+  soil_program_idx program;
+  uint8_t pf;
+  uint8_t hook;
+  int32_t priority;
+  uint8_t flags;
+  uint64_t instruction_budget;
+  uint64_t *handle;
+};
+
+struct soil_nf_stats {
+  uint64_t packets;
+  uint64_t instructions;
+  uint64_t drops;
+  uint64_t aborts;
+};
+
+struct soil_nf_stats_args {
+  uint64_t handle;
+  struct soil_nf_stats *stats;
+};
+
+// Channels connect a sending and a receiving VM. Each VM has
+// SOIL_VM_CHANNELS slots that channels can be bound to. Guests use them
+// through these syscalls:
+//   send(a = slot, b = address, c = length) -> a = 0, or -1 if closed
+//   receive(a = slot, b = address, c = capacity) -> a = message length
+//   try_receive(a = slot, b = address, c = capacity) -> a = length or -1
+#define SOIL_VM_CHANNELS 8
+#define SOIL_CHANNEL_SEND 0
+#define SOIL_CHANNEL_RECEIVE 1
+#define SOIL_SYSCALL_CHANNEL_SEND 128
+#define SOIL_SYSCALL_CHANNEL_RECEIVE 129
+#define SOIL_SYSCALL_CHANNEL_TRY_RECEIVE 130
+// sleep(a = nanoseconds). instant_now (16) returns a monotonic time in
+// nanoseconds.
+#define SOIL_SYSCALL_SLEEP 131
+
+// Bulk operations on guest memory, checked once per range:
+//   mem_copy(a = dst, b = src, c = len), the ranges must not overlap
+//   mem_move(a = dst, b = src, c = len)
+//   mem_fill(a = dst, b = byte, c = len)
+//   mem_compare(a = lhs, b = rhs, c = len) -> a = -1, 0 or 1
+//   mem_find_byte(a = addr, b = byte, c = len) -> a = offset or -1
+#define SOIL_SYSCALL_MEM_COPY 144
+#define SOIL_SYSCALL_MEM_MOVE 145
+#define SOIL_SYSCALL_MEM_FILL 146
+#define SOIL_SYSCALL_MEM_COMPARE 147
+#define SOIL_SYSCALL_MEM_FIND_BYTE 148
+
+// Guest threads share the guest memory of the VM that spawned them but have
+// their own registers and stacks. Atomic operations work on 8-byte aligned
+// words; futex_wait parks the thread while the word holds the expected value.
+//   spawn(a = entry, b = stack pointer, c = argument) -> a = thread id or -1
+//   join(a = thread id) -> a = exit code of the thread or -1
+//   atomic_cas(a = addr, b = expected, c = new) -> a = old value
+//   atomic_fetch_add(a = addr, b = delta) -> a = old value
+//   futex_wait(a = addr, b = expected) -> a = 0 once woken or -1
+//   futex_wake(a = addr, b = count) -> a = number of threads woken
+#define SOIL_SYSCALL_SPAWN 160
+#define SOIL_SYSCALL_JOIN 161
+#define SOIL_SYSCALL_ATOMIC_CAS 162
+#define SOIL_SYSCALL_ATOMIC_FETCH_ADD 163
+#define SOIL_SYSCALL_FUTEX_WAIT 164
+#define SOIL_SYSCALL_FUTEX_WAKE 165
+#define SOIL_MAX_THREADS 64
+
+struct soil_channel_args {
+  uint64_t capacity;
+  uint64_t *channel;
+};
+
+struct soil_channel_bind_args {
+  soil_vm_idx vm;
+  uint64_t channel;
+  uint8_t slot;
+  uint8_t end;
+};
+
+// Per NUMA node: runs of VMs placed on it, how many of those ran on another
+// node's CPU and the guest memory allocated on it in bytes.
+struct soil_numa_stats {
+  uint64_t runs;
+  uint64_t remote_runs;
+  uint64_t memory;
+};
+
+struct soil_numa_stats_args {
+  int32_t node;
+  struct soil_numa_stats *stats;
+};
+
+// Shared segments are read-only blobs mapped into every VM of a program at a
+// fixed guest address behind guest memory. Their contents come from user
+// space. Stores into a segment panic unless it was attached with
+// SOIL_SEGMENT_COPY_ON_WRITE, in which case the VM gets a private copy of the
+// page it writes to. Syscalls can read from segments but not write to them.
+// Masked VMs can't reach segments.
+#define SOIL_MAX_SEGMENTS 8
+#define SOIL_SEGMENT_COPY_ON_WRITE 1
+
+struct soil_segment_args {
+  const Byte *data;
+  uint64_t len;
+  uint64_t *segment;
+};
+
+struct soil_segment_attach_args {
+  soil_program_idx program;
+  uint64_t segment;
+  Word base;
+  uint8_t flags;
+};
+
+struct soil_batch_input {
+  int argc;
+  char **argv;
+  Byte *input;
+  uint64_t input_len;
+  Byte *output;
+  uint64_t output_cap;
+};
+
+struct soil_batch_result {
+  Word exit_code;
+  uint64_t output_len;
+  soil_vm_status_t status;
+  int error;
+};
+
+struct soil_batch_args {
+  soil_program_idx program;
+  struct soil_batch_input *inputs;
+  struct soil_batch_result *results;
+  uint64_t len;
+  uint32_t parallelism;
+  uint8_t flags;
+  struct soil_vm_qos qos;
+};
+
 #define IOC_MAGIC 100
 #define SOIL_IOCTL_LOAD_BINARY _IOWR(IOC_MAGIC, 0, struct soil_program*)
 #define SOIL_IOCTL_CREATE_VM _IOWR(IOC_MAGIC, 1, soil_vm_idx*)
@@ -42,5 +278,20 @@ struct soil_vm_status_args {
 #define SOIL_IOCTL_VM_STATUS _IOWR(IOC_MAGIC, 3, struct soil_vm_status_args*)
 #define SOIL_IOCTL_UNLOAD_BINARY _IOW(IOC_MAGIC, 4, soil_program_idx)
 #define SOIL_IOCTL_DELETE_VM _IOW(IOC_MAGIC, 5, soil_vm_idx)
+#define SOIL_IOCTL_RUN_BATCH _IOWR(IOC_MAGIC, 6, struct soil_batch_args*)
+#define SOIL_IOCTL_PAUSE_VM _IOW(IOC_MAGIC, 7, soil_vm_idx)
+#define SOIL_IOCTL_CHECKPOINT _IOWR(IOC_MAGIC, 8, struct soil_vm_checkpoint_args*)
+#define SOIL_IOCTL_RESTORE _IOW(IOC_MAGIC, 9, struct soil_vm_restore_args*)
+#define SOIL_IOCTL_NF_ATTACH _IOWR(IOC_MAGIC, 10, struct soil_nf_attach_args*)
+#define SOIL_IOCTL_NF_DETACH _IOW(IOC_MAGIC, 11, uint64_t)
+#define SOIL_IOCTL_NF_STATS _IOWR(IOC_MAGIC, 12, struct soil_nf_stats_args*)
+#define SOIL_IOCTL_CREATE_CHANNEL _IOWR(IOC_MAGIC, 13, struct soil_channel_args*)
+#define SOIL_IOCTL_BIND_CHANNEL _IOW(IOC_MAGIC, 14, struct soil_channel_bind_args*)
+#define SOIL_IOCTL_DESTROY_CHANNEL _IOW(IOC_MAGIC, 15, uint64_t)
+#define SOIL_IOCTL_CREATE_VM_ON_NODE _IOW(IOC_MAGIC, 16, struct soil_vm_create_args*)
+#define SOIL_IOCTL_NUMA_STATS _IOWR(IOC_MAGIC, 17, struct soil_numa_stats_args*)
+#define SOIL_IOCTL_CREATE_SEGMENT _IOWR(IOC_MAGIC, 18, struct soil_segment_args*)
+#define SOIL_IOCTL_ATTACH_SEGMENT _IOW(IOC_MAGIC, 19, struct soil_segment_attach_args*)
+#define SOIL_IOCTL_DESTROY_SEGMENT _IOW(IOC_MAGIC, 20, uint64_t)
 
 #endif
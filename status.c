@@ -0,0 +1,66 @@
+#include "vm.h"
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/mm.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>
+
+// The status of every VM in the VM table is published in an array of
+// SOIL_MAX_VMS entries that user space can map read-only from /dev/soil, so
+// monitoring doesn't need a syscall per VM. Only the thread currently running
+// a VM (or the ioctl handling it while it doesn't run) updates its entry.
+// Readers retry while the sequence number is odd or changed under them.
+
+static struct soil_vm_status_entry *status_entries;
+
+static unsigned long status_entries_size(void) {
+  return PAGE_ALIGN(SOIL_MAX_VMS * sizeof(struct soil_vm_status_entry));
+}
+
+void publish_vm_status(soil_vm_t *vm) {
+  if (vm->idx < 0 || vm->idx >= SOIL_MAX_VMS)
+    return;
+  struct soil_vm_status_entry *entry = &status_entries[vm->idx];
+  soil_vm_status_t status = READ_ONCE(vm->status);
+  // The VM is about to let go of its thread.
+  if (status == SOIL_VM_PARKING)
+    status = SOIL_VM_PARKED;
+
+  WRITE_ONCE(entry->seq, entry->seq + 1);
+  smp_wmb();
+  WRITE_ONCE(entry->status, status);
+  WRITE_ONCE(entry->exit_code, vm->exit_code);
+  WRITE_ONCE(entry->instructions, vm->instructions);
+  WRITE_ONCE(entry->started_ns, vm->started_ns);
+  WRITE_ONCE(entry->stopped_ns, vm->stopped_ns);
+  smp_wmb();
+  WRITE_ONCE(entry->seq, entry->seq + 1);
+}
+
+// Called for VM table slots that become free.
+void clear_vm_status(Word idx) {
+  if (idx < 0 || idx >= SOIL_MAX_VMS)
+    return;
+  struct soil_vm_status_entry *entry = &status_entries[idx];
+  WRITE_ONCE(entry->seq, entry->seq + 1);
+  smp_wmb();
+  memset((Byte *)entry + sizeof(entry->seq), 0,
+         sizeof(*entry) - sizeof(entry->seq));
+  smp_wmb();
+  WRITE_ONCE(entry->seq, entry->seq + 1);
+}
+
+int mmap_vm_status(struct vm_area_struct *vma) {
+  if (vma->vm_flags & VM_WRITE)
+    return -EPERM;
+  vm_flags_clear(vma, VM_MAYWRITE);
+  return remap_vmalloc_range(vma, status_entries, vma->vm_pgoff);
+}
+
+int init_vm_status(void) {
+  // Zeroed and suitable for mapping into user space.
+  status_entries = vmalloc_user(status_entries_size());
+  return status_entries ? 0 : -ENOMEM;
+}
+
+void destroy_vm_status(void) { vfree(status_entries); }
@@ -0,0 +1,110 @@
+#include "vm.h"
+#include <linux/export.h>
+#include <linux/kernel.h>
+#include <linux/kref.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+
+// Syscalls are dispatched through a table bound to each VM. Loading a program
+// snapshots the built-in syscalls together with the native handlers other
+// modules registered at that point, so VMs never see the table change under
+// them. A snapshot holds a reference on every module providing one of its
+// handlers, which keeps those modules loaded until the program is unloaded
+// and its VMs are gone.
+
+extern soil_syscall_fn syscall_handlers[256];
+void init_syscalls(void);
+void syscall_none(soil_vm_t *vm);
+
+static DEFINE_MUTEX(extensions_lock);
+static soil_syscall_fn extension_handlers[256];
+static struct module *extension_owners[256];
+
+static struct soil_syscall_table builtin_syscalls;
+
+static void free_syscall_table(struct kref *ref) {
+  struct soil_syscall_table *table =
+      container_of(ref, struct soil_syscall_table, ref);
+  for (int i = 0; i < 256; i++)
+    if (table->owners[i])
+      module_put(table->owners[i]);
+  kfree(table);
+}
+
+struct soil_syscall_table *get_syscall_table(struct soil_syscall_table *table) {
+  kref_get(&table->ref);
+  return table;
+}
+
+void put_syscall_table(struct soil_syscall_table *table) {
+  // The built-in table is static and its initial reference is never dropped.
+  kref_put(&table->ref, free_syscall_table);
+}
+
+// The built-in table lives as long as the module, so no reference is taken.
+struct soil_syscall_table *builtin_syscall_table(void) {
+  return &builtin_syscalls;
+}
+
+bool is_free_syscall(u8 number) {
+  return builtin_syscalls.handlers[number] == syscall_none;
+}
+
+struct soil_syscall_table *snapshot_syscall_table(void) {
+  struct soil_syscall_table *table = kzalloc(sizeof(*table), GFP_KERNEL);
+  if (table == NULL)
+    return NULL;
+  kref_init(&table->ref);
+  memcpy(table->handlers, builtin_syscalls.handlers, sizeof(table->handlers));
+
+  mutex_lock(&extensions_lock);
+  for (int i = 0; i < 256; i++) {
+    if (extension_handlers[i] == NULL)
+      continue;
+    if (extension_owners[i] && !try_module_get(extension_owners[i]))
+      continue;
+    table->handlers[i] = extension_handlers[i];
+    table->owners[i] = extension_owners[i];
+  }
+  mutex_unlock(&extensions_lock);
+  return table;
+}
+
+void bind_syscall_table(soil_vm_t *vm, struct soil_syscall_table *table) {
+  struct soil_syscall_table *old = vm->syscalls;
+  vm->syscalls = get_syscall_table(table);
+  if (old)
+    put_syscall_table(old);
+}
+
+int soil_register_syscall(u8 number, soil_syscall_fn fn, struct module *owner) {
+  if (fn == NULL)
+    return -EINVAL;
+  int res = 0;
+  mutex_lock(&extensions_lock);
+  if (!is_free_syscall(number) || extension_handlers[number] != NULL) {
+    res = -EBUSY;
+  } else {
+    extension_handlers[number] = fn;
+    extension_owners[number] = owner;
+  }
+  mutex_unlock(&extensions_lock);
+  return res;
+}
+EXPORT_SYMBOL_GPL(soil_register_syscall);
+
+void soil_unregister_syscall(u8 number) {
+  mutex_lock(&extensions_lock);
+  extension_handlers[number] = NULL;
+  extension_owners[number] = NULL;
+  mutex_unlock(&extensions_lock);
+}
+EXPORT_SYMBOL_GPL(soil_unregister_syscall);
+
+void init_syscall_tables(void) {
+  init_syscalls();
+  kref_init(&builtin_syscalls.ref);
+  memcpy(builtin_syscalls.handlers, syscall_handlers,
+         sizeof(builtin_syscalls.handlers));
+}
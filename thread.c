@@ -0,0 +1,308 @@
+#include "vm.h"
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+
+// Guest threads are VMs of their own that share the guest memory, byte code
+// and syscalls of the VM that spawned them. They start out parked and are
+// unparked onto the soil workqueue, so they run on whatever CPU it picks.
+// A VM and all threads spawned from it form a thread group with the VM that
+// started it all as thread 0. When thread 0 stops for good, the others are
+// stopped too, and guest memory isn't touched by them anymore once it is
+// reused. Threads that finished stay in the group until they are joined, so
+// their exit code can be collected.
+
+struct soil_thread_group {
+  spinlock_t lock;
+  // Thread n + 1 lives in slot n.
+  soil_vm_t *threads[SOIL_MAX_THREADS];
+  // Threads that are still running or parked.
+  int live;
+  bool exiting;
+  // Guest memory written by threads that were joined already.
+  Word dirty_lo;
+  Word dirty_hi;
+  struct list_head futex_waiters;
+  wait_queue_head_t idle;
+};
+
+#define REGA ((vm)->reg[SOIL_REG_A])
+#define REGB ((vm)->reg[SOIL_REG_B])
+#define REGC ((vm)->reg[SOIL_REG_C])
+
+static bool is_thread(soil_vm_t *vm) { return vm->group && vm->tid != 0; }
+
+static struct soil_thread_group *get_thread_group(soil_vm_t *vm) {
+  if (vm->group)
+    return vm->group;
+  struct soil_thread_group *g = kzalloc(sizeof(*g), GFP_KERNEL);
+  if (g == NULL)
+    return NULL;
+  spin_lock_init(&g->lock);
+  g->dirty_lo = MEMORY_ALLOC_SIZE;
+  INIT_LIST_HEAD(&g->futex_waiters);
+  init_waitqueue_head(&g->idle);
+  vm->group = g;
+  vm->tid = 0;
+  return g;
+}
+
+static void free_thread(soil_vm_t *thread) {
+  cancel_vm_parking(thread);
+  bind_vm_segments(thread, NULL);
+  bind_vm_resume_qos(thread, NULL, NULL);
+  put_syscall_table(thread->syscalls);
+  kfree(thread->call_stack);
+  kfree(thread->try_stack);
+  kfree(thread);
+}
+
+// Must be called with the group locked.
+static void reap_thread(struct soil_thread_group *g, soil_vm_t *thread) {
+  g->threads[thread->tid - 1] = NULL;
+  // Threads stopped by their deadline may still be waiting to join another.
+  for (int i = 0; i < SOIL_MAX_THREADS; i++)
+    if (g->threads[i] && g->threads[i]->joiner == thread)
+      g->threads[i]->joiner = NULL;
+  g->dirty_lo = min3(g->dirty_lo, thread->dirty_lo, thread->stack_lo);
+  g->dirty_hi = max3(g->dirty_hi, thread->dirty_hi, thread->stack_hi);
+}
+
+// Must be called with the group locked.
+static void thread_exited(struct soil_thread_group *g, soil_vm_t *thread) {
+  list_del_init(&thread->futex_node);
+  thread->thread_done = true;
+  if (thread->joiner) {
+    soil_vm_unpark(thread->joiner);
+    thread->joiner = NULL;
+  }
+  if (--g->live == 0)
+    wake_up_all(&g->idle);
+}
+
+// Called by the worker that ran a thread once it stopped for good. This is
+// the last time the worker touches the thread.
+void guest_thread_stopped(soil_vm_t *vm) {
+  struct soil_thread_group *g = vm->group;
+  spin_lock(&g->lock);
+  thread_exited(g, vm);
+  spin_unlock(&g->lock);
+}
+
+bool is_stopped_guest_thread(soil_vm_t *vm) {
+  if (!is_thread(vm))
+    return false;
+  soil_vm_status_t status = READ_ONCE(vm->status);
+  return status != SOIL_VM_RUNNING && status != SOIL_VM_PARKING &&
+         status != SOIL_VM_PARKED;
+}
+
+// Stops all other threads of the group thread 0 belongs to, waits for them
+// and dissolves the group.
+void release_guest_threads(soil_vm_t *vm) {
+  struct soil_thread_group *g = vm->group;
+  if (g == NULL || vm->tid != 0)
+    return;
+
+  spin_lock(&g->lock);
+  g->exiting = true;
+  for (int i = 0; i < SOIL_MAX_THREADS; i++) {
+    soil_vm_t *thread = g->threads[i];
+    if (thread == NULL || thread->thread_done)
+      continue;
+    // Sleeps and channel waits park without the group lock, so the status
+    // can change under us. Nobody runs parked threads, so they are done right
+    // away. Running ones stop after their current instruction and, like
+    // threads that stopped on their own, report back.
+    for (;;) {
+      soil_vm_status_t status = READ_ONCE(thread->status);
+      if (status == SOIL_VM_PARKED) {
+        if (cmpxchg(&thread->status, status, SOIL_VM_EXITED) == status) {
+          thread_exited(g, thread);
+          break;
+        }
+      } else if (status == SOIL_VM_RUNNING || status == SOIL_VM_PARKING) {
+        if (cmpxchg(&thread->status, status, SOIL_VM_EXITED) == status)
+          break;
+      } else {
+        break;
+      }
+    }
+  }
+  spin_unlock(&g->lock);
+
+  wait_event(g->idle, READ_ONCE(g->live) == 0);
+  // The last thread to stop may still be on its way out of the lock.
+  spin_lock(&g->lock);
+  spin_unlock(&g->lock);
+  for (int i = 0; i < SOIL_MAX_THREADS; i++) {
+    soil_vm_t *thread = g->threads[i];
+    if (thread == NULL)
+      continue;
+    reap_thread(g, thread);
+    free_thread(thread);
+  }
+
+  vm->dirty_lo = min(vm->dirty_lo, g->dirty_lo);
+  vm->dirty_hi = max(vm->dirty_hi, g->dirty_hi);
+  vm->group = NULL;
+  kfree(g);
+}
+
+static Word *guest_word(soil_vm_t *vm, Word addr, bool write) {
+  if (addr % sizeof(Word) != 0) {
+    soil_vm_panic(vm, "unaligned atomic access at %lx", addr);
+    return NULL;
+  }
+  Word *word = (Word *)soil_guest_ptr(vm, addr, sizeof(Word), write);
+  if (word == NULL)
+    soil_vm_panic(vm, "invalid atomic access at %lx", addr);
+  return word;
+}
+
+void syscall_spawn(soil_vm_t *vm) {
+  if (!soil_vm_can_park(vm)) {
+    soil_vm_panic(vm, "threads are not supported in atomic context");
+    return;
+  }
+  struct soil_thread_group *g = get_thread_group(vm);
+  soil_vm_t *thread = g ? alloc_vm(vm->numa_node) : NULL;
+  if (thread == NULL) {
+    REGA = -1;
+    return;
+  }
+  bind_syscall_table(thread, vm->syscalls);
+  bind_vm_segments(thread, vm->segments);
+  share_vm_resume_qos(thread, vm);
+  thread->byte_code = vm->byte_code;
+  thread->byte_code_len = vm->byte_code_len;
+  thread->labels = vm->labels;
+  thread->mem = vm->mem;
+  thread->mem_size = vm->mem_size;
+  thread->mem_mask = vm->mem_mask;
+  thread->flags = vm->flags;
+  thread->instruction_budget = vm->instruction_budget;
+  thread->deadline = vm->deadline;
+  // Limits are checked after the first instruction, which sets up the next
+  // check.
+  thread->next_check = 0;
+  thread->started_ns = ktime_get_ns();
+  thread->ip = REGA;
+  thread->reg[SOIL_REG_SP] = REGB;
+  thread->reg[SOIL_REG_A] = REGC;
+  thread->group = g;
+  thread->status = SOIL_VM_PARKED;
+
+  spin_lock(&g->lock);
+  int slot = -1;
+  for (int i = 0; i < SOIL_MAX_THREADS && !g->exiting; i++) {
+    if (g->threads[i] == NULL) {
+      slot = i;
+      break;
+    }
+  }
+  if (slot >= 0) {
+    thread->tid = slot + 1;
+    g->threads[slot] = thread;
+    g->live++;
+    soil_vm_unpark(thread);
+  }
+  spin_unlock(&g->lock);
+
+  if (slot < 0) {
+    free_thread(thread);
+    REGA = -1;
+    return;
+  }
+  REGA = thread->tid;
+}
+
+void syscall_join(soil_vm_t *vm) {
+  struct soil_thread_group *g = vm->group;
+  Word tid = REGA;
+  if (g == NULL || tid < 1 || tid > SOIL_MAX_THREADS || tid == vm->tid) {
+    REGA = -1;
+    return;
+  }
+  spin_lock(&g->lock);
+  soil_vm_t *thread = g->threads[tid - 1];
+  if (thread == NULL || (thread->joiner && thread->joiner != vm)) {
+    spin_unlock(&g->lock);
+    REGA = -1;
+    return;
+  }
+  if (!thread->thread_done) {
+    // The thread unparks us when it's done and we try again.
+    thread->joiner = vm;
+    soil_vm_park_restart(vm);
+    spin_unlock(&g->lock);
+    return;
+  }
+  reap_thread(g, thread);
+  spin_unlock(&g->lock);
+  REGA = thread->exit_code;
+  free_thread(thread);
+}
+
+void syscall_atomic_cas(soil_vm_t *vm) {
+  Word *word = guest_word(vm, REGA, true);
+  if (word)
+    REGA = cmpxchg(word, REGB, REGC);
+}
+
+void syscall_atomic_fetch_add(soil_vm_t *vm) {
+  Word *word = guest_word(vm, REGA, true);
+  if (word == NULL)
+    return;
+  Word old = READ_ONCE(*word);
+  while (!try_cmpxchg(word, &old, old + REGB))
+    ;
+  REGA = old;
+}
+
+void syscall_futex_wait(soil_vm_t *vm) {
+  Word *word = guest_word(vm, REGA, false);
+  if (word == NULL)
+    return;
+  struct soil_thread_group *g = vm->group;
+  // Without other threads, nobody could ever wake us.
+  if (g == NULL) {
+    REGA = -1;
+    return;
+  }
+  spin_lock(&g->lock);
+  if (READ_ONCE(*word) != REGB || g->exiting) {
+    spin_unlock(&g->lock);
+    REGA = -1;
+    return;
+  }
+  vm->futex_addr = REGA;
+  // Still queued if an earlier wait was woken by its deadline.
+  list_move_tail(&vm->futex_node, &g->futex_waiters);
+  REGA = 0;
+  soil_vm_park(vm);
+  spin_unlock(&g->lock);
+}
+
+void syscall_futex_wake(soil_vm_t *vm) {
+  struct soil_thread_group *g = vm->group;
+  Word woken = 0;
+  if (g) {
+    soil_vm_t *waiter, *next;
+    spin_lock(&g->lock);
+    list_for_each_entry_safe(waiter, next, &g->futex_waiters, futex_node) {
+      if (woken >= REGB)
+        break;
+      if (waiter->futex_addr != REGA)
+        continue;
+      list_del_init(&waiter->futex_node);
+      soil_vm_unpark(waiter);
+      woken++;
+    }
+    spin_unlock(&g->lock);
+  }
+  REGA = woken;
+}
@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
 int main(int argc, char **argv) {
@@ -90,7 +91,26 @@ int main(int argc, char **argv) {
 
     printf("VM status: %d\n", *(status_args.status));
     sleep(5);
-  } while (*(status_args.status) != SOIL_VM_EXITED);
+  } while (*(status_args.status) == SOIL_VM_INIT ||
+           *(status_args.status) == SOIL_VM_STARTING ||
+           *(status_args.status) == SOIL_VM_RUNNING ||
+           *(status_args.status) == SOIL_VM_PARKING ||
+           *(status_args.status) == SOIL_VM_PARKED);
+
+  // The same information, and some more, is also available without a syscall.
+  const struct soil_vm_status_entry *entries =
+      mmap(NULL, SOIL_MAX_VMS * sizeof(struct soil_vm_status_entry), PROT_READ,
+           MAP_SHARED, fd, 0);
+  if (entries == MAP_FAILED) {
+    perror("mmap");
+  } else {
+    struct soil_vm_status_entry entry;
+    soil_read_vm_status(&entries[vm], &entry);
+    printf("VM exited with %lld after %llu instructions in %llu ns\n",
+           (long long)entry.exit_code, (unsigned long long)entry.instructions,
+           (unsigned long long)(entry.stopped_ns - entry.started_ns));
+    munmap((void *)entries, SOIL_MAX_VMS * sizeof(struct soil_vm_status_entry));
+  }
 
   close(fd);
   return 0;
@@ -1,10 +1,15 @@
 // #include <stdarg.h>
 // #include <stdint.h>
 #include "vm.h"
+#include <linux/build_bug.h>
 #include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
 #include <linux/module.h>
+#include <linux/numa.h>
 #include <linux/slab.h>
 #include <linux/string.h>
+#include <linux/topology.h>
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Clemens Tiedt");
@@ -28,6 +33,7 @@ void soil_panic(soil_vm_t *vm, int exit_code, const char *fmt, ...) {
   printk(KERN_INFO "%pV", &vaf);
   va_end(args);
   if (vm) {
+    vm->exit_code = exit_code;
     vm->status = SOIL_VM_EXITED;
   }
 }
@@ -41,7 +47,9 @@ void soil_panic(soil_vm_t *vm, int exit_code, const char *fmt, ...) {
 #define REGE ((vm)->reg[6])
 #define REGF ((vm)->reg[7])
 
-void (*syscall_handlers[256])(soil_vm_t *);
+// The built-in syscalls. VMs dispatch through the table bound to them, which
+// starts out as a copy of this one (see syscalls.c).
+soil_syscall_fn syscall_handlers[256];
 
 LabelAndPos find_label(soil_vm_t *vm, Word pos) {
   for (int j = vm->labels.len - 1; j >= 0; j--)
@@ -68,6 +76,16 @@ void dump_and_panic(soil_vm_t *vm, char *fmt, ...) {
       .fmt = fmt,
   };
   va_start(args, fmt);
+  vaf.va = &args;
+  // VMs in atomic context panic once per packet at worst, so they only get
+  // a rate-limited line instead of a dump.
+  if (vm->flags & SOIL_VM_ATOMIC) {
+    printk_ratelimited(KERN_INFO "soil: packet filter panicked: %pV\n", &vaf);
+    va_end(args);
+    vm->exit_code = 1;
+    vm->status = SOIL_VM_EXITED;
+    return;
+  }
   printk(KERN_INFO "%pV", &vaf);
   va_end(args);
 
@@ -87,27 +105,209 @@ void dump_and_panic(soil_vm_t *vm, char *fmt, ...) {
   eprintf("e  = %8ld %8lx\n", REGE, REGE);
   eprintf("f  = %8ld %8lx\n", REGF, REGF);
   eprintf("\n");
+  vm->exit_code = 1;
   vm->status = SOIL_VM_EXITED;
-  // TODO: Deal with file io...
-  // FILE* dump = fopen("crash", "w+");
-  // fwrite(mem, 1, MEMORY_SIZE, dump);
-  // fclose(dump);
-  // eprintf("Memory dumped to crash.\n");
-  // exit(1);
+  dump_vm_to_file(vm);
 }
 
-void init_syscalls(void);
+void soil_vm_panic(soil_vm_t *vm, const char *fmt, ...) {
+  va_list args;
+  struct va_format vaf = {
+      .fmt = fmt,
+  };
+  va_start(args, fmt);
+  vaf.va = &args;
+  dump_and_panic(vm, "%pV", &vaf);
+  va_end(args);
+}
+EXPORT_SYMBOL_GPL(soil_vm_panic);
+
+soil_vm_t *alloc_vm(int node) {
+  BUILD_BUG_ON(offsetof(soil_vm_t, dirty_lo) > 2 * SMP_CACHE_BYTES);
+  BUILD_BUG_ON(offsetof(soil_vm_t, byte_code_len) > 4 * SMP_CACHE_BYTES);
+  // Zeroed so that init_vm can tell that there is no byte code, debug info,
+  // guest memory or stack to free yet.
+  soil_vm_t *vm = kzalloc_node(sizeof(soil_vm_t), GFP_KERNEL, node);
+  if (vm) {
+    vm->idx = -1;
+    vm->numa_node = node;
+    vm->mem_node = NUMA_NO_NODE;
+    init_vm_parking(vm);
+    INIT_LIST_HEAD(&vm->futex_node);
+    vm->dirty_lo = MEMORY_ALLOC_SIZE;
+    vm->stack_lo = MEMORY_ALLOC_SIZE;
+    vm->syscalls = get_syscall_table(builtin_syscall_table());
+  }
+  return vm;
+}
+
+void deinit_vm(soil_vm_t *vm) {
+  // Threads run the byte code and touch guest memory until they are stopped.
+  release_guest_threads(vm);
+  kfree(vm->byte_code);
+  vm->byte_code = 0;
+  vm->byte_code_len = 0;
+  if (vm->labels.len != 0)
+    kfree(vm->labels.entries);
+  vm->labels.len = 0;
+  reset_vm_segments(vm);
+}
+
+static void free_vm_memory(soil_vm_t *vm) {
+  if (vm->mem == NULL)
+    return;
+  account_numa_memory(vm->mem_node, -MEMORY_ALLOC_SIZE);
+  kvfree(vm->mem);
+  vm->mem = NULL;
+  vm->mem_node = NUMA_NO_NODE;
+  vm->dirty_lo = MEMORY_ALLOC_SIZE;
+  vm->dirty_hi = 0;
+  vm->stack_lo = MEMORY_ALLOC_SIZE;
+  vm->stack_hi = 0;
+}
+
+void free_vm(soil_vm_t *vm) {
+  if (vm == NULL)
+    return;
+  // Neither timers nor the workqueue may touch the VM once it is freed.
+  cancel_vm_parking(vm);
+  deinit_vm(vm);
+  release_vm_channels(vm);
+  bind_vm_segments(vm, NULL);
+  bind_vm_resume_qos(vm, NULL, NULL);
+  put_syscall_table(vm->syscalls);
+  free_vm_memory(vm);
+  kfree(vm->call_stack);
+  kfree(vm->try_stack);
+  kfree(vm);
+}
+
+// Guest memory is allocated on first use and stays with the VM, also while it
+// sits in the pool. If the VM has since moved to another node, the memory is
+// reallocated there, which loses its contents.
+int alloc_vm_memory(soil_vm_t *vm) {
+  if (vm->mem &&
+      (vm->numa_node == NUMA_NO_NODE || vm->mem_node == vm->numa_node))
+    return 0;
+  Byte *mem = kvzalloc_node(MEMORY_ALLOC_SIZE, GFP_KERNEL, vm->numa_node);
+  if (mem == NULL)
+    // Remote memory is still better than none.
+    return vm->mem ? 0 : -ENOMEM;
+  free_vm_memory(vm);
+  vm->mem = mem;
+  vm->mem_node =
+      vm->numa_node == NUMA_NO_NODE ? numa_node_id() : vm->numa_node;
+  account_numa_memory(vm->mem_node, MEMORY_ALLOC_SIZE);
+  return 0;
+}
+
+static int grow_stack(soil_vm_t *vm, void **stack, Word *cap, Word len,
+                      size_t elem_size, Word max_len) {
+  if (len <= *cap)
+    return 0;
+  if (len > max_len)
+    return -ENOSPC;
+  Word new_cap = min(max3(len, *cap * 2, (Word)16), max_len);
+  // VMs in atomic context grow their stacks while processing a packet.
+  gfp_t gfp = vm->flags & SOIL_VM_ATOMIC ? GFP_ATOMIC : GFP_KERNEL;
+  void *grown = krealloc_array(*stack, new_cap, elem_size, gfp);
+  if (grown == NULL)
+    return -ENOMEM;
+  *stack = grown;
+  *cap = new_cap;
+  return 0;
+}
+
+// Makes room for call and try stacks of the given depths.
+int reserve_vm_stacks(soil_vm_t *vm, Word call_stack_len, Word try_stack_len) {
+  int res = grow_stack(vm, (void **)&vm->call_stack, &vm->call_stack_cap,
+                       call_stack_len, sizeof(Word), CALL_STACK_SIZE);
+  if (res)
+    return res;
+  return grow_stack(vm, (void **)&vm->try_stack, &vm->try_stack_cap,
+                    try_stack_len, sizeof(Try), TRY_STACK_SIZE);
+}
+
+static void clear_range(soil_vm_t *vm, Word lo, Word hi) {
+  lo = max_t(Word, lo, 0);
+  hi = min_t(Word, hi, MEMORY_ALLOC_SIZE);
+  if (hi > lo)
+    memset(vm->mem + lo, 0, hi - lo);
+}
+
+// Zeroes only the part of guest memory the previous program wrote to.
+void clear_vm_memory(soil_vm_t *vm) {
+  clear_range(vm, vm->dirty_lo, vm->dirty_hi);
+  clear_range(vm, vm->stack_lo, vm->stack_hi);
+  vm->dirty_lo = MEMORY_ALLOC_SIZE;
+  vm->dirty_hi = 0;
+  vm->stack_lo = MEMORY_ALLOC_SIZE;
+  vm->stack_hi = 0;
+}
+
+static inline void mark_dirty(soil_vm_t *vm, Word addr, Word len) {
+  if (addr < vm->dirty_lo)
+    vm->dirty_lo = addr;
+  if (addr + len > vm->dirty_hi)
+    vm->dirty_hi = addr + len;
+}
 
-void init_vm(soil_vm_t *vm, Byte *bin, int bin_len) {
+static inline void mark_stack_dirty(soil_vm_t *vm, Word addr) {
+  if (addr < vm->stack_lo)
+    vm->stack_lo = addr;
+  if (addr + 8 > vm->stack_hi)
+    vm->stack_hi = addr + 8;
+}
+
+// Ranges behind guest memory may lie in a shared segment, which syscalls can
+// read but not write.
+Byte *soil_guest_ptr(soil_vm_t *vm, Word addr, Word len, bool write) {
+  if (len < 0)
+    return NULL;
+  if ((u64)addr > (u64)vm->mem_size || (u64)len > (u64)(vm->mem_size - addr)) {
+    if (write || (vm->flags & SOIL_EXEC_MASKED_MEMORY))
+      return NULL;
+    return segment_ptr(vm, addr, len);
+  }
+  if (write)
+    mark_dirty(vm, addr, len);
+  return vm->mem + addr;
+}
+EXPORT_SYMBOL_GPL(soil_guest_ptr);
+
+void init_vm(soil_vm_t *vm, Byte *bin, int bin_len, u8 flags) {
+  vm->flags = flags;
+  if (flags & SOIL_EXEC_MASKED_MEMORY) {
+    // Masking needs a power of two, so a memory cap rounds down to one.
+    vm->mem_size = MASKED_MEMORY_SIZE;
+    if (vm->memory_cap != 0 && vm->memory_cap < MASKED_MEMORY_SIZE)
+      vm->mem_size = rounddown_pow_of_two(max_t(u64, vm->memory_cap, 8));
+  } else {
+    // The range checks assume that there is room for at least one word.
+    vm->mem_size = MEMORY_SIZE;
+    if (vm->memory_cap != 0 && vm->memory_cap < MEMORY_SIZE)
+      vm->mem_size = max_t(u64, vm->memory_cap, 8);
+  }
+  vm->mem_mask = vm->mem_size - 1;
   for (int i = 0; i < 8; i++)
     vm->reg[i] = 0;
-  SP = MEMORY_SIZE;
-  vm->byte_code = 0;
+  SP = vm->mem_size;
+  // A VM may be initialized several times (batch runs, the execute syscall),
+  // so release whatever the previous program left behind.
+  deinit_vm(vm);
   vm->ip = 0;
   vm->call_stack_len = 0;
-  vm->status = SOIL_VM_INIT;
-
-  init_syscalls();
+  vm->try_stack_len = 0;
+  vm->exit_code = 0;
+  vm->input_pos = 0;
+  vm->output_len = 0;
+  // A VM claimed for a run stays claimed until run() starts it.
+  if (vm->status != SOIL_VM_STARTING)
+    vm->status = SOIL_VM_INIT;
+  if (alloc_vm_memory(vm) != 0) {
+    soil_panic(vm, 2, "out of memory");
+    return;
+  }
 
   int cursor = 0;
 #define EAT_BYTE                                                               \
@@ -142,13 +342,15 @@ void init_vm(soil_vm_t *vm, Byte *bin, int bin_len) {
     int section_len = EAT_WORD;
     if (section_type == 0) {
       // byte code
-      vm->byte_code = kmalloc(section_len, GFP_KERNEL);
+      vm->byte_code = kmalloc_node(section_len, GFP_KERNEL, vm->numa_node);
+      vm->byte_code_len = section_len;
       for (int j = 0; j < section_len; j++)
         vm->byte_code[j] = EAT_BYTE;
     } else if (section_type == 1) {
       // initial memory
-      if (section_len >= MEMORY_SIZE)
+      if (section_len >= vm->mem_size)
         soil_panic(vm, 1, "initial memory too big");
+      mark_dirty(vm, 0, section_len);
       for (int j = 0; j < section_len; j++)
         vm->mem[j] = EAT_BYTE;
     } else if (section_type == 3) {
@@ -184,7 +386,71 @@ typedef union {
   int64_t i;
 } fi;
 
-void run_single(soil_vm_t *vm) {
+// Translates a guest address for an access of size bytes. In masked mode, the
+// address is wrapped into guest memory without branching and the guard region
+// behind it absorbs accesses straddling the end. Otherwise, addresses are
+// range checked and NULL is returned for invalid ones.
+static __always_inline Byte *guest_addr(soil_vm_t *vm, Word addr, Word size,
+                                        const bool masked) {
+  if (masked)
+    return vm->mem + (addr & vm->mem_mask);
+  if ((u64)addr > (u64)(vm->mem_size - size))
+    return NULL;
+  return vm->mem + addr;
+}
+
+// Called for accesses that failed the range check. Addresses that would be
+// valid if it weren't for the memory cap end the VM with a distinct status.
+static noinline void invalid_access(soil_vm_t *vm, Word addr, Word size,
+                                    const char *what) {
+  if (vm->mem_size < MEMORY_SIZE && (u64)addr <= (u64)(MEMORY_SIZE - size)) {
+    if (SOIL_TRACED(vm))
+      eprintf("%s at %lx exceeds the memory cap of %ld bytes\n", what, addr,
+              vm->mem_size);
+    vm->exit_code = 1;
+    vm->status = SOIL_VM_MEMORY_EXCEEDED;
+    return;
+  }
+  dump_and_panic(vm, "%s", what);
+}
+
+// Unwinds to the innermost try block, or ends the VM if there is none.
+static noinline void guest_panic(soil_vm_t *vm, const char *why) {
+  if (vm->try_stack_len == 0) {
+    dump_and_panic(vm, "%s", why);
+    return;
+  }
+  vm->try_stack_len--;
+  vm->call_stack_len = vm->try_stack[vm->try_stack_len].call_stack_len;
+  vm->ip = vm->try_stack[vm->try_stack_len].catch;
+}
+
+// Loads and stores that failed the range check may still hit a shared segment.
+static noinline bool slow_load(soil_vm_t *vm, Word addr, Word size,
+                               Word *value, const char *what) {
+  Word loaded = 0;
+  if (read_segment(vm, addr, &loaded, size) != 0) {
+    invalid_access(vm, addr, size, what);
+    return false;
+  }
+  *value = loaded;
+  return true;
+}
+
+static noinline bool slow_store(soil_vm_t *vm, Word addr, Word size,
+                                Word value, const char *what) {
+  int res = write_segment(vm, addr, &value, size);
+  if (res == -EFAULT)
+    invalid_access(vm, addr, size, what);
+  else if (res != 0)
+    dump_and_panic(vm, "%s into read-only segment at %lx", what, addr);
+  return res == 0;
+}
+
+// traced is false for VMs in atomic context, which must not printk per
+// instruction.
+static __always_inline void run_single(soil_vm_t *vm, const bool masked,
+                                       const bool traced) {
 #define REG1 vm->reg[vm->byte_code[vm->ip + 1] & 0x0f]
 #define REG2 vm->reg[vm->byte_code[vm->ip + 1] >> 4]
 
@@ -193,18 +459,15 @@ void run_single(soil_vm_t *vm) {
   case 0x00:
     vm->ip += 1;
     break;     // nop
-  case 0xe0: { // panic
-    if (vm->try_stack_len > 0) {
-      vm->try_stack_len--;
-      vm->call_stack_len = vm->try_stack[vm->try_stack_len].call_stack_len;
-      vm->ip = vm->try_stack[vm->try_stack_len].catch;
-      break;
-    } else {
-      dump_and_panic(vm, "panicked");
+  case 0xe0: // panic
+    guest_panic(vm, "panicked");
+    break;
+  case 0xe1: { // trystart
+    if (unlikely(vm->try_stack_len == vm->try_stack_cap) &&
+        reserve_vm_stacks(vm, 0, vm->try_stack_len + 1) != 0) {
+      guest_panic(vm, "try stack overflow");
       return;
     }
-  }
-  case 0xe1: { // trystart
     Word catch = *(Word *)(vm->byte_code + vm->ip + 1);
     vm->try_stack[vm->try_stack_len].catch = catch;
     vm->try_stack[vm->try_stack_len].call_stack_len = vm->call_stack_len;
@@ -213,10 +476,14 @@ void run_single(soil_vm_t *vm) {
     vm->ip += 9;
     break;
   }
-  case 0xe2:
+  case 0xe2: // tryend
+    if (unlikely(vm->try_stack_len == 0)) {
+      dump_and_panic(vm, "tryend without trystart");
+      return;
+    }
     vm->try_stack_len--;
     vm->ip += 1;
-    break; // tryend
+    break;
   case 0xd0:
     REG1 = REG2;
     vm->ip += 2;
@@ -230,43 +497,74 @@ void run_single(soil_vm_t *vm) {
     vm->ip += 3;
     break;     // moveib
   case 0xd3: { // load
-    if (REG2 >= MEMORY_SIZE)
-      dump_and_panic(vm, "invalid load");
-    REG1 = *(Word *)(vm->mem + REG2);
+    Byte *addr = guest_addr(vm, REG2, 8, masked);
+    if (addr == NULL) {
+      if (!slow_load(vm, REG2, 8, &REG1, "invalid load"))
+        return;
+    } else {
+      REG1 = *(Word *)addr;
+    }
     vm->ip += 2;
     break;
   }
   case 0xd4: { // loadb
-    if (REG2 >= MEMORY_SIZE)
-      dump_and_panic(vm, "invalid loadb");
-    REG1 = vm->mem[REG2];
+    Byte *addr = guest_addr(vm, REG2, 1, masked);
+    if (addr == NULL) {
+      if (!slow_load(vm, REG2, 1, &REG1, "invalid loadb"))
+        return;
+    } else {
+      REG1 = *addr;
+    }
     vm->ip += 2;
     break;
   }
   case 0xd5: { // store
-    if (REG1 >= MEMORY_SIZE)
-      dump_and_panic(vm, "invalid store");
-    *(Word *)(vm->mem + REG1) = REG2;
+    Byte *addr = guest_addr(vm, REG1, 8, masked);
+    if (addr == NULL) {
+      if (!slow_store(vm, REG1, 8, REG2, "invalid store"))
+        return;
+    } else {
+      *(Word *)addr = REG2;
+      mark_dirty(vm, addr - vm->mem, 8);
+    }
     vm->ip += 2;
     break;
   }
   case 0xd6: { // storeb
-    if (REG1 >= MEMORY_SIZE)
-      dump_and_panic(vm, "invalid storeb");
-    vm->mem[REG1] = REG2;
+    Byte *addr = guest_addr(vm, REG1, 1, masked);
+    if (addr == NULL) {
+      if (!slow_store(vm, REG1, 1, REG2, "invalid storeb"))
+        return;
+    } else {
+      *addr = REG2;
+      mark_dirty(vm, addr - vm->mem, 1);
+    }
     vm->ip += 2;
     break;
   }
-  case 0xd7:
+  case 0xd7: { // push
+    Byte *addr = guest_addr(vm, SP - 8, 8, masked);
+    if (addr == NULL) {
+      invalid_access(vm, SP - 8, 8, "stack overflow");
+      return;
+    }
     SP -= 8;
-    *(Word *)(vm->mem + SP) = REG1;
+    *(Word *)addr = REG1;
+    mark_stack_dirty(vm, addr - vm->mem);
     vm->ip += 2;
-    break; // push
-  case 0xd8:
-    REG1 = *(Word *)(vm->mem + SP);
+    break;
+  }
+  case 0xd8: { // pop
+    Byte *addr = guest_addr(vm, SP, 8, masked);
+    if (addr == NULL) {
+      invalid_access(vm, SP, 8, "stack underflow");
+      return;
+    }
+    REG1 = *(Word *)addr;
     SP += 8;
     vm->ip += 2;
-    break; // pop
+    break;
+  }
   case 0xf0:
     vm->ip = *(Word *)(vm->byte_code + vm->ip + 1);
     break;     // jump
@@ -278,7 +576,7 @@ void run_single(soil_vm_t *vm) {
     break;
   }
   case 0xf2: { // call
-    if (TRACE_CALLS) {
+    if (TRACE_CALLS && traced) {
       for (int i = 0; i < vm->call_stack_len; i++)
         eprintf(" ");
       LabelAndPos lap = find_label(vm, *(Word *)(vm->byte_code + vm->ip + 1));
@@ -296,6 +594,11 @@ void run_single(soil_vm_t *vm) {
       eprintf("\n");
     }
 
+    if (unlikely(vm->call_stack_len == vm->call_stack_cap) &&
+        reserve_vm_stacks(vm, vm->call_stack_len + 1, 0) != 0) {
+      guest_panic(vm, "call stack overflow");
+      return;
+    }
     Word return_target = vm->ip + 9;
     vm->call_stack[vm->call_stack_len] = return_target;
     vm->call_stack_len++;
@@ -303,13 +606,17 @@ void run_single(soil_vm_t *vm) {
     break;
   }
   case 0xf3: { // ret
+    if (unlikely(vm->call_stack_len == 0)) {
+      dump_and_panic(vm, "ret with an empty call stack");
+      return;
+    }
     vm->call_stack_len--;
     vm->ip = vm->call_stack[vm->call_stack_len];
     break;
   }
   case 0xf4:
     vm->ip += 2;
-    syscall_handlers[vm->byte_code[vm->ip - 1]](vm);
+    vm->syscalls->handlers[vm->byte_code[vm->ip - 1]](vm);
     break; // syscall
   case 0xc0:
     ST = REG1 - REG2;
@@ -408,15 +715,19 @@ void run_single(soil_vm_t *vm) {
     vm->ip += 2;
     break;     // mul
   case 0xa3: { // div
-    if (REG2 == 0)
+    if (REG2 == 0) {
       dump_and_panic(vm, "div by zero");
+      return;
+    }
     REG1 /= REG2;
     vm->ip += 2;
     break;
   }
   case 0xa4: { // rem
-    if (REG2 == 0)
+    if (REG2 == 0) {
       dump_and_panic(vm, "rem by zero");
+      return;
+    }
     REG1 %= REG2;
     vm->ip += 2;
     break;
@@ -474,52 +785,164 @@ void run_single(soil_vm_t *vm) {
     dump_and_panic(vm, "invalid instruction %dx", opcode);
     return;
   }
-  if (TRACE_INSTRUCTIONS) {
+  if (TRACE_INSTRUCTIONS && traced) {
     eprintf("ran %x -> ", opcode);
     dump_reg(vm);
   }
 }
 
-void run(soil_vm_t *vm) {
-  vm->status = SOIL_VM_RUNNING;
-  for (int i = 0; vm->status != SOIL_VM_EXITED; i++) {
+#define LIMIT_CHECK_INTERVAL 1024
+
+// Enforces the instruction budget and deadline. The run loop only calls this
+// every LIMIT_CHECK_INTERVAL instructions or when the budget runs out, so
+// reading the clock and rescheduling stay off the per-instruction path.
+static noinline void check_limits(soil_vm_t *vm) {
+  // Packet filters run out of budget at packet rate, and their statistics
+  // count aborts already.
+  if (vm->instructions >= vm->instruction_budget) {
+    if (SOIL_TRACED(vm))
+      eprintf("instruction budget of %llu exhausted\n", vm->instruction_budget);
+    cmpxchg(&vm->status, SOIL_VM_RUNNING, SOIL_VM_BUDGET_EXCEEDED);
+    return;
+  }
+  if (vm->deadline != 0 && ktime_get_ns() >= vm->deadline) {
+    if (SOIL_TRACED(vm))
+      eprintf("deadline exceeded after %llu instructions\n", vm->instructions);
+    cmpxchg(&vm->status, SOIL_VM_RUNNING, SOIL_VM_DEADLINE_EXCEEDED);
+    return;
+  }
+  vm->next_check =
+      min(vm->instruction_budget, vm->instructions + LIMIT_CHECK_INTERVAL);
+  publish_vm_status(vm);
+  if (!(vm->flags & SOIL_VM_ATOMIC))
+    cond_resched();
+}
+
+static __always_inline void run_loop(soil_vm_t *vm, const bool masked,
+                                     const bool traced) {
+  while (vm->status == SOIL_VM_RUNNING) {
     // dump_reg();
     // eprintf("Memory:");
     // for (int i = 0x18650; i < MEMORY_SIZE; i++)
     //   eprintf("%c%02x", i == SP ? '|' : ' ', mem[i]);
     // eprintf("\n");
-    run_single(vm);
+    run_single(vm, masked, traced);
+    if (unlikely(++vm->instructions >= vm->next_check))
+      check_limits(vm);
   }
 }
 
+// Runs the VM until it stops or parks. Parked VMs come back here once they
+// are unparked.
+void continue_vm(soil_vm_t *vm) {
+  do {
+    publish_vm_status(vm);
+    // The loop is instantiated once per addressing mode and for VMs in atomic
+    // context, which skip tracing, so that neither is checked per instruction.
+    bool masked = vm->flags & SOIL_EXEC_MASKED_MEMORY;
+    if (vm->flags & SOIL_VM_ATOMIC) {
+      if (masked)
+        run_loop(vm, true, false);
+      else
+        run_loop(vm, false, false);
+    } else {
+      if (masked)
+        run_loop(vm, true, true);
+      else
+        run_loop(vm, false, true);
+    }
+    // SOIL_IOCTL_PAUSE_VM asked us to stop; the VM is now between
+    // instructions.
+    if (vm->status == SOIL_VM_PAUSING)
+      vm->status = SOIL_VM_PAUSED;
+    soil_vm_status_t status = READ_ONCE(vm->status);
+    if (status != SOIL_VM_PARKING && status != SOIL_VM_RUNNING) {
+      // When thread 0 of a thread group stops, the other threads stop too.
+      if (status != SOIL_VM_PAUSED)
+        release_guest_threads(vm);
+      vm->stopped_ns = ktime_get_ns();
+    }
+    publish_vm_status(vm);
+    // VMs in atomic context never park, and nobody waits for them.
+  } while (!(vm->flags & SOIL_VM_ATOMIC) && finish_parking(vm));
+}
+
+void run(soil_vm_t *vm) {
+  vm->instructions = 0;
+  vm->next_check = min_t(u64, vm->instruction_budget, LIMIT_CHECK_INTERVAL);
+  vm->started_ns = ktime_get_ns();
+  vm->stopped_ns = 0;
+  vm->running = true;
+  // init_vm failed, so there is nothing to run.
+  if (vm->status == SOIL_VM_EXITED) {
+    vm->stopped_ns = vm->started_ns;
+    publish_vm_status(vm);
+    if (!(vm->flags & SOIL_VM_ATOMIC))
+      vm_runner_done(vm);
+    return;
+  }
+  vm->status = SOIL_VM_RUNNING;
+  continue_vm(vm);
+}
+
+static Byte *guest_range(soil_vm_t *vm, Word addr, Word len, bool write) {
+  Byte *ptr = soil_guest_ptr(vm, addr, len, write);
+  if (ptr == NULL)
+    dump_and_panic(vm, "invalid memory range %lx+%ld", addr, len);
+  return ptr;
+}
+
 void syscall_none(soil_vm_t *vm) {
   dump_and_panic(vm, "invalid syscall number");
 }
 void syscall_exit(soil_vm_t *vm) {
-  if (TRACE_SYSCALLS)
+  if (TRACE_SYSCALLS && SOIL_TRACED(vm))
     eprintf("syscall exit(%ld)\n", REGA);
-  eprintf("exited with %ld\n", REGA);
+  if (SOIL_TRACED(vm))
+    eprintf("exited with %ld\n", REGA);
   // exit(REGA);
+  vm->exit_code = REGA;
   vm->status = SOIL_VM_EXITED;
 }
 void syscall_print(soil_vm_t *vm) {
-  if (TRACE_SYSCALLS)
+  if (TRACE_SYSCALLS && SOIL_TRACED(vm))
     eprintf("syscall print(%lx, %ld)\n", REGA, REGB);
+  if (vm->output) {
+    // Batch runs collect stdout in a buffer instead of the kernel log.
+    Byte *src = guest_range(vm, REGA, REGB, false);
+    if (src == NULL)
+      return;
+    u64 len = min_t(u64, REGB, vm->output_cap - vm->output_len);
+    memcpy(vm->output + vm->output_len, src, len);
+    vm->output_len += len;
+    return;
+  }
+  // Packet filters would flood the kernel log, so their output is dropped.
+  if (!SOIL_TRACED(vm))
+    return;
+  Byte *str = guest_range(vm, REGA, REGB, false);
+  if (str == NULL)
+    return;
   for (int i = 0; i < REGB; i++)
-    printk(KERN_INFO "%c", vm->mem[REGA + i]);
+    printk(KERN_INFO "%c", str[i]);
   if (TRACE_CALLS || TRACE_SYSCALLS)
     eprintf("\n");
 }
 void syscall_log(soil_vm_t *vm) {
-  if (TRACE_SYSCALLS)
+  if (TRACE_SYSCALLS && SOIL_TRACED(vm))
     eprintf("syscall log(%lx, %ld)\n", REGA, REGB);
+  if (!SOIL_TRACED(vm))
+    return;
+  Byte *str = guest_range(vm, REGA, REGB, false);
+  if (str == NULL)
+    return;
   for (int i = 0; i < REGB; i++)
-    eprintf("%c", vm->mem[REGA + i]);
+    eprintf("%c", str[i]);
   if (TRACE_CALLS || TRACE_SYSCALLS)
     eprintf("\n");
 }
 void syscall_create(soil_vm_t *vm) {
-  if (TRACE_SYSCALLS)
+  if (TRACE_SYSCALLS && SOIL_TRACED(vm))
     eprintf("syscall create(%lx, %ld)\n", REGA, REGB);
   char filename[REGB + 1];
   for (int i = 0; i < REGB; i++)
@@ -529,7 +952,7 @@ void syscall_create(soil_vm_t *vm) {
   // TODO: Replace with kernel file IO
 }
 void syscall_open_reading(soil_vm_t *vm) {
-  if (TRACE_SYSCALLS)
+  if (TRACE_SYSCALLS && SOIL_TRACED(vm))
     eprintf("syscall open_reading(%lx, %ld)\n", REGA, REGB);
   char filename[REGB + 1];
   for (int i = 0; i < REGB; i++)
@@ -539,7 +962,7 @@ void syscall_open_reading(soil_vm_t *vm) {
   // TODO: Replace with kernel file IO
 }
 void syscall_open_writing(soil_vm_t *vm) {
-  if (TRACE_SYSCALLS)
+  if (TRACE_SYSCALLS && SOIL_TRACED(vm))
     eprintf("syscall open_writing(%lx, %ld)\n", REGA, REGB);
   char filename[REGB + 1];
   for (int i = 0; i < REGB; i++)
@@ -549,64 +972,133 @@ void syscall_open_writing(soil_vm_t *vm) {
   // TODO: Replace with kernel file IO
 }
 void syscall_read(soil_vm_t *vm) {
-  if (TRACE_SYSCALLS)
+  if (TRACE_SYSCALLS && SOIL_TRACED(vm))
     eprintf("syscall read(%ld, %lx, %ld)\n", REGA, REGB, REGC);
   // REGA = fread(mem + REGB, 1, REGC, (FILE*)REGA);
   // TODO: Replace with kernel file IO
 }
 void syscall_write(soil_vm_t *vm) {
-  if (TRACE_SYSCALLS)
+  if (TRACE_SYSCALLS && SOIL_TRACED(vm))
     eprintf("syscall write(%ld, %lx, %ld)\n", REGA, REGB, REGC);
   // TODO: assert that this worked
   // fwrite(mem + REGB, 1, REGC, (FILE*)REGA);
   // TODO: Replace with kernel file IO
 }
 void syscall_close(soil_vm_t *vm) {
-  if (TRACE_SYSCALLS)
+  if (TRACE_SYSCALLS && SOIL_TRACED(vm))
     eprintf("syscall close(%ld)\n", REGA);
   // TODO: assert that this worked
   // fclose((FILE*)REGA);
   // TODO: Replace with kernel file IO
 }
-int global_argc;
 void syscall_argc(soil_vm_t *vm) {
-  if (TRACE_SYSCALLS)
+  if (TRACE_SYSCALLS && SOIL_TRACED(vm))
     eprintf("syscall argc()\n");
-  REGA = global_argc - 1;
+  REGA = vm->argc;
 }
-char **global_argv;
 void syscall_arg(soil_vm_t *vm) {
-  if (TRACE_SYSCALLS)
+  if (TRACE_SYSCALLS && SOIL_TRACED(vm))
     eprintf("syscall arg(%ld, %lx, %ld)\n", REGA, REGB, REGC);
-  if (REGA < 0 || REGA >= global_argc)
+  if (REGA < 0 || REGA >= vm->argc) {
     dump_and_panic(vm, "arg index out of bounds");
-  char *arg = REGA == 0 ? global_argv[0] : global_argv[REGA + 1];
+    return;
+  }
+  char *arg = vm->argv[REGA];
   int len = strlen(arg);
   int written = len > REGC ? REGC : len;
-  for (int i = 0; i < written; i++)
-    vm->mem[REGB + i] = arg[i];
+  Byte *dst = guest_range(vm, REGB, written, true);
+  if (dst == NULL)
+    return;
+  memcpy(dst, arg, written);
   REGA = written;
 }
 void syscall_read_input(soil_vm_t *vm) {
-  if (TRACE_SYSCALLS)
+  if (TRACE_SYSCALLS && SOIL_TRACED(vm))
     eprintf("syscall read_input(%lx, %ld)\n", REGA, REGB);
+  if (vm->input) {
+    Byte *dst = guest_range(vm, REGA, REGB, true);
+    if (dst == NULL)
+      return;
+    u64 len = min_t(u64, REGB, vm->input_len - vm->input_pos);
+    memcpy(dst, vm->input + vm->input_pos, len);
+    vm->input_pos += len;
+    REGA = len;
+    return;
+  }
   // REGA = read(0, mem + REGA, REGB);
   dump_and_panic(vm, "Input is not supported in kernel mode");
 }
 void syscall_execute(soil_vm_t *vm) {
-  if (TRACE_SYSCALLS)
+  if (TRACE_SYSCALLS && SOIL_TRACED(vm))
     eprintf("syscall execute(%lx, %ld)\n", REGA, REGB);
+  if (vm->flags & SOIL_VM_ATOMIC) {
+    dump_and_panic(vm, "execute is not supported in atomic context");
+    return;
+  }
+  // The byte code and guest memory belong to thread 0.
+  if (vm->tid != 0) {
+    dump_and_panic(vm, "execute is not supported in guest threads");
+    return;
+  }
   int len = REGB;
   Byte *bin = (Byte *)kmalloc(len, GFP_KERNEL);
   if (bin == NULL)
     soil_panic(vm, 2, "out of memory");
   memcpy(bin, vm->mem + REGA, len);
-  init_vm(vm, bin, len);
+  init_vm(vm, bin, len, vm->flags);
 }
 void syscall_instant_now(soil_vm_t *vm) {
-  if (TRACE_SYSCALLS)
+  if (TRACE_SYSCALLS && SOIL_TRACED(vm))
     eprintf("syscall instant_now()\n");
-  REGA = 0;
+  REGA = ktime_get_ns();
+}
+
+static void syscall_mem_copy(soil_vm_t *vm) {
+  if (TRACE_SYSCALLS && SOIL_TRACED(vm))
+    eprintf("syscall mem_copy(%lx, %lx, %ld)\n", REGA, REGB, REGC);
+  Byte *src = guest_range(vm, REGB, REGC, false);
+  Byte *dst = src ? guest_range(vm, REGA, REGC, true) : NULL;
+  if (dst == NULL)
+    return;
+  if (dst < src + REGC && src < dst + REGC) {
+    dump_and_panic(vm, "mem_copy of overlapping ranges");
+    return;
+  }
+  memcpy(dst, src, REGC);
+}
+static void syscall_mem_move(soil_vm_t *vm) {
+  if (TRACE_SYSCALLS && SOIL_TRACED(vm))
+    eprintf("syscall mem_move(%lx, %lx, %ld)\n", REGA, REGB, REGC);
+  Byte *src = guest_range(vm, REGB, REGC, false);
+  Byte *dst = src ? guest_range(vm, REGA, REGC, true) : NULL;
+  if (dst)
+    memmove(dst, src, REGC);
+}
+static void syscall_mem_fill(soil_vm_t *vm) {
+  if (TRACE_SYSCALLS && SOIL_TRACED(vm))
+    eprintf("syscall mem_fill(%lx, %ld, %ld)\n", REGA, REGB, REGC);
+  Byte *dst = guest_range(vm, REGA, REGC, true);
+  if (dst)
+    memset(dst, (Byte)REGB, REGC);
+}
+static void syscall_mem_compare(soil_vm_t *vm) {
+  if (TRACE_SYSCALLS && SOIL_TRACED(vm))
+    eprintf("syscall mem_compare(%lx, %lx, %ld)\n", REGA, REGB, REGC);
+  Byte *lhs = guest_range(vm, REGA, REGC, false);
+  Byte *rhs = lhs ? guest_range(vm, REGB, REGC, false) : NULL;
+  if (rhs == NULL)
+    return;
+  int res = memcmp(lhs, rhs, REGC);
+  REGA = res < 0 ? -1 : res > 0 ? 1 : 0;
+}
+static void syscall_mem_find_byte(soil_vm_t *vm) {
+  if (TRACE_SYSCALLS && SOIL_TRACED(vm))
+    eprintf("syscall mem_find_byte(%lx, %ld, %ld)\n", REGA, REGB, REGC);
+  Byte *haystack = guest_range(vm, REGA, REGC, false);
+  if (haystack == NULL)
+    return;
+  Byte *found = memchr(haystack, (Byte)REGB, REGC);
+  REGA = found ? found - haystack : -1;
 }
 
 void init_syscalls(void) {
@@ -626,4 +1118,20 @@ void init_syscalls(void) {
   syscall_handlers[11] = syscall_read_input;
   syscall_handlers[12] = syscall_execute;
   syscall_handlers[16] = syscall_instant_now;
+  syscall_handlers[SOIL_SYSCALL_CHANNEL_SEND] = syscall_channel_send;
+  syscall_handlers[SOIL_SYSCALL_CHANNEL_RECEIVE] = syscall_channel_receive;
+  syscall_handlers[SOIL_SYSCALL_CHANNEL_TRY_RECEIVE] =
+      syscall_channel_try_receive;
+  syscall_handlers[SOIL_SYSCALL_SLEEP] = syscall_sleep;
+  syscall_handlers[SOIL_SYSCALL_MEM_COPY] = syscall_mem_copy;
+  syscall_handlers[SOIL_SYSCALL_MEM_MOVE] = syscall_mem_move;
+  syscall_handlers[SOIL_SYSCALL_MEM_FILL] = syscall_mem_fill;
+  syscall_handlers[SOIL_SYSCALL_MEM_COMPARE] = syscall_mem_compare;
+  syscall_handlers[SOIL_SYSCALL_MEM_FIND_BYTE] = syscall_mem_find_byte;
+  syscall_handlers[SOIL_SYSCALL_SPAWN] = syscall_spawn;
+  syscall_handlers[SOIL_SYSCALL_JOIN] = syscall_join;
+  syscall_handlers[SOIL_SYSCALL_ATOMIC_CAS] = syscall_atomic_cas;
+  syscall_handlers[SOIL_SYSCALL_ATOMIC_FETCH_ADD] = syscall_atomic_fetch_add;
+  syscall_handlers[SOIL_SYSCALL_FUTEX_WAIT] = syscall_futex_wait;
+  syscall_handlers[SOIL_SYSCALL_FUTEX_WAKE] = syscall_futex_wake;
 }
@@ -1,7 +1,14 @@
 #ifndef VM_H
 #define VM_H
 
+#include <linux/cache.h>
+#include <linux/cpumask.h>
+#include <linux/hrtimer.h>
+#include <linux/kref.h>
+#include <linux/list.h>
+#include <linux/sched.h>
 #include <linux/types.h>
+#include <linux/workqueue.h>
 
 typedef u8 Byte;
 typedef s64 Word;
@@ -13,6 +20,16 @@ typedef enum {
   SOIL_VM_INIT,
   SOIL_VM_RUNNING,
   SOIL_VM_EXITED,
+  SOIL_VM_PAUSING,
+  SOIL_VM_PAUSED,
+  SOIL_VM_BUDGET_EXCEEDED,
+  SOIL_VM_DEADLINE_EXCEEDED,
+  SOIL_VM_MEMORY_EXCEEDED,
+  // Waiting for a syscall to complete, without holding on to a thread.
+  SOIL_VM_PARKING,
+  SOIL_VM_PARKED,
+  // Claimed by SOIL_IOCTL_RUN, about to run.
+  SOIL_VM_STARTING,
 } soil_vm_status_t;
 
 struct soil_program
@@ -23,11 +40,50 @@ struct soil_program
 };
 
 #define SOIL_EXEC_ASYNC 1
+// Guest memory is a power of two in size and addresses wrap around instead
+// of being range checked.
+#define SOIL_EXEC_MASKED_MEMORY 2
+// Continue a paused or restored VM instead of starting the program afresh.
+#define SOIL_EXEC_RESUME 4
+// Place the VM on qos.numa_node. Otherwise, a VM stays on the node it first
+// ran on.
+#define SOIL_EXEC_NUMA_NODE 8
+// Internal: the VM runs in atomic context and must not sleep.
+#define SOIL_VM_ATOMIC 0x80
+// The flags user space may pass; the ioctls drop all others.
+#define SOIL_EXEC_FLAGS                                                        \
+  (SOIL_EXEC_ASYNC | SOIL_EXEC_MASKED_MEMORY | SOIL_EXEC_RESUME |              \
+   SOIL_EXEC_NUMA_NODE)
+
+#define SOIL_PRIO_NORMAL 0
+#define SOIL_PRIO_REALTIME 1
+
+// Limits for a run. Zero means unlimited for the budget, deadline and memory
+// cap. The CPU mask and priority only apply to threads the module starts, that
+// is async and batch runs, and to the workers they resume on after parking;
+// synchronous runs execute on the calling thread. Real-time runs resume at the
+// highest nice level.
+struct soil_vm_qos {
+  const unsigned long *cpu_mask;
+  u32 cpu_mask_len;
+  u32 priority_class;
+  s32 nice;
+  u64 instruction_budget;
+  u64 deadline_ns;
+  u64 memory_cap;
+  s32 numa_node;
+};
+
+struct soil_vm_create_args {
+  s32 numa_node;
+  soil_vm_idx *vm;
+};
 
 struct soil_vm_run_args {
   soil_program_idx program;
   soil_vm_idx vm;
   u8 flags;
+  struct soil_vm_qos qos;
 };
 
 struct soil_vm_status_args {
@@ -35,6 +91,183 @@ struct soil_vm_status_args {
   soil_vm_status_t *status;
 };
 
+// The status of the VM in each VM table slot is published in an array of
+// SOIL_MAX_VMS entries that can be mapped read-only with mmap on /dev/soil.
+// seq is odd while an entry is being updated; read it before and after the
+// other fields and retry if it was odd or changed in between.
+#define SOIL_MAX_VMS 1024
+
+struct soil_vm_status_entry {
+  u32 seq;
+  u32 status;
+  s64 exit_code;
+  u64 instructions;
+  u64 started_ns;
+  u64 stopped_ns;
+  u64 reserved[3];
+};
+
+struct soil_vm_checkpoint_args {
+  soil_vm_idx vm;
+  Byte *buf;
+  u64 cap;
+  u64 *len;
+};
+
+struct soil_vm_restore_args {
+  soil_vm_idx vm;
+  Byte *buf;
+  u64 len;
+};
+
+// Programs attached to a netfilter hook run once per packet. The packet is
+// copied to SOIL_NF_PACKET_ADDR and the program starts with its address in
+// register a and its length in register b. Exiting with SOIL_NF_ACCEPT lets
+// the packet pass; any other exit, a panic or running out of budget drops it.
+#define SOIL_NF_PACKET_ADDR 0x80000
+#define SOIL_NF_PACKET_MAX 0x10000
+#define SOIL_NF_ACCEPT 0
+
+struct soil_nf_attach_args {
+  soil_program_idx program;
+  u8 pf;
+  u8 hook;
+  s32 priority;
+  u8 flags;
+  u64 instruction_budget;
+  u64 *handle;
+};
+
+struct soil_nf_stats {
+  u64 packets;
+  u64 instructions;
+  u64 drops;
+  u64 aborts;
+};
+
+struct soil_nf_stats_args {
+  u64 handle;
+  struct soil_nf_stats *stats;
+};
+
+// Channels connect a sending and a receiving VM. Each VM has
+// SOIL_VM_CHANNELS slots that channels can be bound to. Guests use them
+// through these syscalls:
+//   send(a = slot, b = address, c = length) -> a = 0, or -1 if closed
+//   receive(a = slot, b = address, c = capacity) -> a = message length
+//   try_receive(a = slot, b = address, c = capacity) -> a = length or -1
+#define SOIL_VM_CHANNELS 8
+#define SOIL_CHANNEL_SEND 0
+#define SOIL_CHANNEL_RECEIVE 1
+#define SOIL_SYSCALL_CHANNEL_SEND 128
+#define SOIL_SYSCALL_CHANNEL_RECEIVE 129
+#define SOIL_SYSCALL_CHANNEL_TRY_RECEIVE 130
+// sleep(a = nanoseconds). instant_now (16) returns a monotonic time in
+// nanoseconds.
+#define SOIL_SYSCALL_SLEEP 131
+
+// Bulk operations on guest memory, checked once per range:
+//   mem_copy(a = dst, b = src, c = len), the ranges must not overlap
+//   mem_move(a = dst, b = src, c = len)
+//   mem_fill(a = dst, b = byte, c = len)
+//   mem_compare(a = lhs, b = rhs, c = len) -> a = -1, 0 or 1
+//   mem_find_byte(a = addr, b = byte, c = len) -> a = offset or -1
+#define SOIL_SYSCALL_MEM_COPY 144
+#define SOIL_SYSCALL_MEM_MOVE 145
+#define SOIL_SYSCALL_MEM_FILL 146
+#define SOIL_SYSCALL_MEM_COMPARE 147
+#define SOIL_SYSCALL_MEM_FIND_BYTE 148
+
+// Guest threads share the guest memory of the VM that spawned them but have
+// their own registers and stacks. Atomic operations work on 8-byte aligned
+// words; futex_wait parks the thread while the word holds the expected value.
+//   spawn(a = entry, b = stack pointer, c = argument) -> a = thread id or -1
+//   join(a = thread id) -> a = exit code of the thread or -1
+//   atomic_cas(a = addr, b = expected, c = new) -> a = old value
+//   atomic_fetch_add(a = addr, b = delta) -> a = old value
+//   futex_wait(a = addr, b = expected) -> a = 0 once woken or -1
+//   futex_wake(a = addr, b = count) -> a = number of threads woken
+#define SOIL_SYSCALL_SPAWN 160
+#define SOIL_SYSCALL_JOIN 161
+#define SOIL_SYSCALL_ATOMIC_CAS 162
+#define SOIL_SYSCALL_ATOMIC_FETCH_ADD 163
+#define SOIL_SYSCALL_FUTEX_WAIT 164
+#define SOIL_SYSCALL_FUTEX_WAKE 165
+#define SOIL_MAX_THREADS 64
+
+struct soil_channel_args {
+  u64 capacity;
+  u64 *channel;
+};
+
+struct soil_channel_bind_args {
+  soil_vm_idx vm;
+  u64 channel;
+  u8 slot;
+  u8 end;
+};
+
+// Per NUMA node: runs of VMs placed on it, how many of those ran on another
+// node's CPU and the guest memory allocated on it in bytes.
+struct soil_numa_stats {
+  u64 runs;
+  u64 remote_runs;
+  u64 memory;
+};
+
+struct soil_numa_stats_args {
+  s32 node;
+  struct soil_numa_stats *stats;
+};
+
+// Shared segments are read-only blobs mapped into every VM of a program at a
+// fixed guest address behind guest memory. Their contents come from user
+// space. Stores into a segment panic unless it was attached with
+// SOIL_SEGMENT_COPY_ON_WRITE, in which case the VM gets a private copy of the
+// page it writes to. Syscalls can read from segments but not write to them.
+// Masked VMs can't reach segments.
+#define SOIL_MAX_SEGMENTS 8
+#define SOIL_SEGMENT_COPY_ON_WRITE 1
+
+struct soil_segment_args {
+  const Byte *data;
+  u64 len;
+  u64 *segment;
+};
+
+struct soil_segment_attach_args {
+  soil_program_idx program;
+  u64 segment;
+  Word base;
+  u8 flags;
+};
+
+struct soil_batch_input {
+  int argc;
+  char **argv;
+  Byte *input;
+  u64 input_len;
+  Byte *output;
+  u64 output_cap;
+};
+
+struct soil_batch_result {
+  Word exit_code;
+  u64 output_len;
+  soil_vm_status_t status;
+  int error;
+};
+
+struct soil_batch_args {
+  soil_program_idx program;
+  struct soil_batch_input *inputs;
+  struct soil_batch_result *results;
+  u64 len;
+  u32 parallelism;
+  u8 flags;
+  struct soil_vm_qos qos;
+};
+
 #define IOC_MAGIC 100
 #define SOIL_IOCTL_LOAD_BINARY _IOWR(IOC_MAGIC, 0, struct soil_program*)
 #define SOIL_IOCTL_CREATE_VM _IOWR(IOC_MAGIC, 1, soil_vm_idx*)
@@ -42,13 +275,34 @@ struct soil_vm_status_args {
 #define SOIL_IOCTL_VM_STATUS _IOWR(IOC_MAGIC, 3, struct soil_vm_status_args*)
 #define SOIL_IOCTL_UNLOAD_BINARY _IOW(IOC_MAGIC, 4, soil_program_idx)
 #define SOIL_IOCTL_DELETE_VM _IOW(IOC_MAGIC, 5, soil_vm_idx)
-
+#define SOIL_IOCTL_RUN_BATCH _IOWR(IOC_MAGIC, 6, struct soil_batch_args*)
+#define SOIL_IOCTL_PAUSE_VM _IOW(IOC_MAGIC, 7, soil_vm_idx)
+#define SOIL_IOCTL_CHECKPOINT _IOWR(IOC_MAGIC, 8, struct soil_vm_checkpoint_args*)
+#define SOIL_IOCTL_RESTORE _IOW(IOC_MAGIC, 9, struct soil_vm_restore_args*)
+#define SOIL_IOCTL_NF_ATTACH _IOWR(IOC_MAGIC, 10, struct soil_nf_attach_args*)
+#define SOIL_IOCTL_NF_DETACH _IOW(IOC_MAGIC, 11, u64)
+#define SOIL_IOCTL_NF_STATS _IOWR(IOC_MAGIC, 12, struct soil_nf_stats_args*)
+#define SOIL_IOCTL_CREATE_CHANNEL _IOWR(IOC_MAGIC, 13, struct soil_channel_args*)
+#define SOIL_IOCTL_BIND_CHANNEL _IOW(IOC_MAGIC, 14, struct soil_channel_bind_args*)
+#define SOIL_IOCTL_DESTROY_CHANNEL _IOW(IOC_MAGIC, 15, u64)
+#define SOIL_IOCTL_CREATE_VM_ON_NODE _IOW(IOC_MAGIC, 16, struct soil_vm_create_args*)
+#define SOIL_IOCTL_NUMA_STATS _IOWR(IOC_MAGIC, 17, struct soil_numa_stats_args*)
+#define SOIL_IOCTL_CREATE_SEGMENT _IOWR(IOC_MAGIC, 18, struct soil_segment_args*)
+#define SOIL_IOCTL_ATTACH_SEGMENT _IOW(IOC_MAGIC, 19, struct soil_segment_attach_args*)
+#define SOIL_IOCTL_DESTROY_SEGMENT _IOW(IOC_MAGIC, 20, u64)
 
 #define MEMORY_SIZE 1000000
+#define MASKED_MEMORY_SIZE (1 << 20)
+#define MEMORY_GUARD 8
+// Guest memory is allocated separately from the VM, guard region included.
+#define MEMORY_ALLOC_SIZE (MASKED_MEMORY_SIZE + MEMORY_GUARD)
 #define TRACE_INSTRUCTIONS 1
 #define TRACE_CALLS 0
 #define TRACE_CALL_ARGS 0
 #define TRACE_SYSCALLS 1
+// VMs in atomic context such as packet filters are never traced.
+#define SOIL_TRACED(vm) (!((vm)->flags & SOIL_VM_ATOMIC))
+// Maximum depths. The stacks start out unallocated and grow on demand.
 #define CALL_STACK_SIZE 1024
 #define TRY_STACK_SIZE 1024
 
@@ -57,21 +311,228 @@ typedef struct { LabelAndPos* entries; int len; } Labels;
 
 typedef struct { Word catch; Word call_stack_len; Word sp; } Try;
 
+struct soil_channel;
+typedef struct { struct soil_channel *channel; u8 end; } ChannelSlot;
+
+
+struct soil_syscall_table;
+struct soil_segment_set;
+struct soil_thread_group;
+struct soil_resume_wq;
+struct vm_area_struct;
 
+// The fields up to flags are touched by every instruction and take the first
+// two 64-byte cache lines; with the rest of the interpreter state up to
+// try_stack_cap, it spans four (alloc_vm checks both at build time). Guest
+// memory and the stacks live in their own allocations, so a VM that hasn't
+// run yet takes up little more than this struct.
 typedef struct soil_vm {
-  Byte *byte_code;
+  // Touched by every instruction.
   Word ip;
   Word reg[8];
-  Byte mem[MEMORY_SIZE];
-  Word call_stack[CALL_STACK_SIZE];
+  Byte *byte_code;
+  Byte *mem;
+  Word mem_mask;
+  Word mem_size;
+  u64 instructions;
+  u64 next_check;
+  soil_vm_status_t status;
+  u8 flags;
+  // Touched by stores, calls, try blocks and syscalls.
+  // Range of guest memory written since the last scrub, and the range written
+  // by pushes, which is kept apart because the stack starts at the other end.
+  Word dirty_lo;
+  Word dirty_hi;
+  Word stack_lo;
+  Word stack_hi;
+  struct soil_syscall_table *syscalls;
+  Word *call_stack;
   Word call_stack_len;
-  Try try_stack[TRY_STACK_SIZE];
+  Word call_stack_cap;
+  Try *try_stack;
   Word try_stack_len;
+  Word try_stack_cap;
+  // Only used by the slow path, syscalls and the ioctls.
+  u64 byte_code_len;
+  u64 instruction_budget;
+  u64 deadline;
+  u64 memory_cap;
   Labels labels;
-  soil_vm_status_t status;
-} soil_vm_t;
+  ChannelSlot channels[SOIL_VM_CHANNELS];
+  struct soil_segment_set *segments;
+  // Pages of copy-on-write segments this VM wrote to, per segment.
+  Byte **cow_pages[SOIL_MAX_SEGMENTS];
+  Word exit_code;
+  int argc;
+  char **argv;
+  Byte *input;
+  u64 input_len;
+  u64 input_pos;
+  Byte *output;
+  u64 output_cap;
+  u64 output_len;
+  // NUMA_NO_NODE until the VM is placed.
+  int numa_node;
+  int mem_node;
+  // Slot in the VM table, or -1.
+  Word idx;
+  u64 started_ns;
+  u64 stopped_ns;
+  struct hrtimer sleep_timer;
+  // Wakes parked VMs when their deadline passes.
+  struct hrtimer deadline_timer;
+  struct work_struct resume_work;
+  // Where the VM resumes after parking; NULL for the default workqueue.
+  struct soil_resume_wq *resume_wq;
+  // Set from the start of a run until the thread that ran the VM last has
+  // published its final status.
+  bool running;
+  struct list_head pool_node;
+  // Guest threads (see thread.c). NULL until the VM spawns one; thread 0 is
+  // the VM that created the group.
+  struct soil_thread_group *group;
+  Word tid;
+  struct soil_vm *joiner;
+  bool thread_done;
+  Word futex_addr;
+  struct list_head futex_node;
+} ____cacheline_aligned soil_vm_t;
+
+#define SOIL_REG_SP 0
+#define SOIL_REG_ST 1
+#define SOIL_REG_A 2
+#define SOIL_REG_B 3
+#define SOIL_REG_C 4
+#define SOIL_REG_D 5
+#define SOIL_REG_E 6
+#define SOIL_REG_F 7
+
+// Native syscalls. Other modules can register handlers for syscall numbers
+// that aren't built in. Each program binds the handlers registered at the time
+// it is loaded. Handlers read arguments from and return results in vm->reg
+// and access guest memory through soil_guest_ptr, which returns NULL for
+// ranges outside of guest memory.
+typedef void (*soil_syscall_fn)(soil_vm_t *vm);
+
+struct soil_syscall_table {
+  struct kref ref;
+  soil_syscall_fn handlers[256];
+  struct module *owners[256];
+};
 
-void init_vm(soil_vm_t *vm, Byte* bin, int bin_len);
+int soil_register_syscall(u8 number, soil_syscall_fn fn, struct module *owner);
+void soil_unregister_syscall(u8 number);
+Byte *soil_guest_ptr(soil_vm_t *vm, Word addr, Word len, bool write);
+void soil_vm_panic(soil_vm_t *vm, const char *fmt, ...);
+
+// Handlers that would block park the VM instead and unpark it once the
+// operation completed (see park.c).
+bool soil_vm_can_park(soil_vm_t *vm);
+void soil_vm_park(soil_vm_t *vm);
+void soil_vm_park_restart(soil_vm_t *vm);
+void soil_vm_unpark(soil_vm_t *vm);
+
+void init_syscall_tables(void);
+bool is_free_syscall(u8 number);
+struct soil_syscall_table *builtin_syscall_table(void);
+struct soil_syscall_table *snapshot_syscall_table(void);
+struct soil_syscall_table *get_syscall_table(struct soil_syscall_table *table);
+void put_syscall_table(struct soil_syscall_table *table);
+void bind_syscall_table(soil_vm_t *vm, struct soil_syscall_table *table);
+
+soil_vm_t *alloc_vm(int node);
+void deinit_vm(soil_vm_t *vm);
+void free_vm(soil_vm_t *vm);
+void init_vm(soil_vm_t *vm, Byte* bin, int bin_len, u8 flags);
+int alloc_vm_memory(soil_vm_t *vm);
+int reserve_vm_stacks(soil_vm_t *vm, Word call_stack_len, Word try_stack_len);
+void clear_vm_memory(soil_vm_t *vm);
 void run(soil_vm_t *vm);
+void continue_vm(soil_vm_t *vm);
+
+int init_parking(void);
+void destroy_parking(void);
+void init_vm_parking(soil_vm_t *vm);
+void cancel_vm_parking(soil_vm_t *vm);
+void stop_vm(soil_vm_t *vm);
+int bind_vm_resume_qos(soil_vm_t *vm, const struct soil_vm_qos *qos,
+                       const struct cpumask *mask);
+void share_vm_resume_qos(soil_vm_t *vm, soil_vm_t *from);
+bool finish_parking(soil_vm_t *vm);
+void vm_runner_done(soil_vm_t *vm);
+void wait_for_runner(soil_vm_t *vm);
+int wait_for_vm(soil_vm_t *vm);
+void syscall_sleep(soil_vm_t *vm);
+
+void set_vm_limits(soil_vm_t *vm, const struct soil_vm_qos *qos);
+int copy_qos_cpumask(const struct soil_vm_qos *qos, struct cpumask *mask);
+void apply_task_priority(struct task_struct *task,
+                         const struct soil_vm_qos *qos);
+
+long attach_nf_program(struct soil_nf_attach_args *args, Byte *bin,
+                        u64 bin_len, struct soil_syscall_table *syscalls,
+                        struct soil_segment_set *segments);
+long detach_nf_program(u64 handle);
+long get_nf_stats(u64 handle, struct soil_nf_stats *stats);
+void detach_all_nf_programs(void);
+
+long create_channel(u64 capacity, u64 *handle);
+long bind_channel(soil_vm_t *vm, u64 handle, u8 slot, u8 end);
+long destroy_channel(u64 handle);
+void release_vm_channels(soil_vm_t *vm);
+void destroy_all_channels(void);
+void syscall_channel_send(soil_vm_t *vm);
+void syscall_channel_receive(soil_vm_t *vm);
+void syscall_channel_try_receive(soil_vm_t *vm);
+
+long create_segment(struct soil_segment_args *args, u64 *handle);
+long attach_segment(struct soil_segment_set **set, u64 handle, Word base,
+                    u8 flags);
+long destroy_segment(u64 handle);
+void destroy_all_segments(void);
+struct soil_segment_set *get_segment_set(struct soil_segment_set *set);
+void put_segment_set(struct soil_segment_set *set);
+void bind_vm_segments(soil_vm_t *vm, struct soil_segment_set *set);
+void reset_vm_segments(soil_vm_t *vm);
+int read_segment(soil_vm_t *vm, Word addr, void *dst, Word len);
+Byte *segment_ptr(soil_vm_t *vm, Word addr, Word len);
+int write_segment(soil_vm_t *vm, Word addr, const void *src, Word len);
+
+void release_guest_threads(soil_vm_t *vm);
+bool is_stopped_guest_thread(soil_vm_t *vm);
+void guest_thread_stopped(soil_vm_t *vm);
+void syscall_spawn(soil_vm_t *vm);
+void syscall_join(soil_vm_t *vm);
+void syscall_atomic_cas(soil_vm_t *vm);
+void syscall_atomic_fetch_add(soil_vm_t *vm);
+void syscall_futex_wait(soil_vm_t *vm);
+void syscall_futex_wake(soil_vm_t *vm);
+
+int init_vm_status(void);
+void destroy_vm_status(void);
+void publish_vm_status(soil_vm_t *vm);
+void clear_vm_status(Word idx);
+int mmap_vm_status(struct vm_area_struct *vma);
+
+void init_vm_pool(void);
+void destroy_vm_pool(void);
+soil_vm_t *pool_get_vm(int node);
+void pool_put_vm(soil_vm_t *vm);
+
+bool valid_numa_node(s32 node);
+int restrict_cpumask_to_node(struct cpumask *mask, int node);
+int place_vm(soil_vm_t *vm, u8 flags, const struct soil_vm_qos *qos,
+             struct cpumask *mask);
+void count_vm_run(soil_vm_t *vm);
+void account_numa_memory(int node, s64 bytes);
+long get_numa_stats(s32 node, struct soil_numa_stats *stats);
+
+long run_batch(struct soil_batch_args *args, Byte *bin, u64 bin_len,
+               struct soil_syscall_table *syscalls,
+               struct soil_segment_set *segments);
+
+ssize_t checkpoint_vm(soil_vm_t *vm, Byte **out);
+int restore_vm(soil_vm_t *vm, const Byte *buf, u64 len);
+void dump_vm_to_file(soil_vm_t *vm);
 
 #endif